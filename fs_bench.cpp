@@ -0,0 +1,196 @@
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <atomic>
+#include <new>
+#include <native/native.h>
+using namespace native;
+
+// usage: (executable)  [work_dir]
+// heap allocations per operation and operations per second of fs::read_stream, fs::append_writer, fs::walk()
+// and single fs::stat/open/read/close requests.
+
+static std::atomic<std::size_t> allocations(0);
+static const std::size_t records = 200000;
+
+void* operator new(std::size_t size)
+{
+    ++allocations;
+    if(void* p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+struct phase
+{
+    phase(const char* name, std::size_t ops)
+        : name_(name)
+        , ops_(ops)
+        , start_allocations_(allocations.load())
+        , start_(std::chrono::steady_clock::now())
+    {}
+
+    void done()
+    {
+        auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count();
+        auto count = allocations.load() - start_allocations_;
+        std::printf("%-16s %8zu ops  %6.3f allocs/op  %10.0f ops/s\n", name_, ops_, double(count) / ops_, ops_ / elapsed);
+    }
+
+    const char* name_;
+    std::size_t ops_;
+    std::size_t start_allocations_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+static void make_file(const std::string& path, std::size_t size)
+{
+    auto f = std::fopen(path.c_str(), "wb");
+    std::string block(64 * 1024, 'x');
+    for(std::size_t n = 0; n < size; n += block.size()) std::fwrite(block.data(), 1, block.size(), f);
+    std::fclose(f);
+}
+
+int main(int argc, char** argv) {
+    std::string dir = argc > 1 ? argv[1] : "/tmp";
+    auto data_file = dir + "/fs_bench.dat";
+    auto log_file = dir + "/fs_bench.log";
+    auto tree = dir + "/fs_bench.tree";
+
+    // read_stream: 4 KiB chunks of a 32 MiB file, 8 reads ahead. One operation is one chunk.
+    const std::size_t file_size = 32 * 1024 * 1024, chunk_size = 4096;
+    make_file(data_file, file_size);
+    for(int round = 0; round < 2; ++round) // the first round warms up the pools
+    {
+        auto p = std::make_shared<phase>("read_stream", file_size / chunk_size);
+        auto s = fs::read_stream::create(data_file, chunk_size, 8);
+        s->start([](read_buffer) {}, [p](error e) {
+            if(e) std::cout << "read_stream failed: " << e.str() << std::endl;
+            p->done();
+        });
+        s.reset();
+        run();
+    }
+
+    // append_writer: 100-byte records with a completion callback each, in groups of at least 4 KiB.
+    // Up to 256 records are waiting at any time: the ones appended while a group is written form the next one.
+    std::remove(log_file.c_str());
+    {
+        struct appender
+        {
+            fs::append_writer_ptr w;
+            std::string record;
+            std::size_t issued, completed;
+
+            void issue()
+            {
+                while(issued < records && issued - completed < 256)
+                {
+                    ++issued;
+                    w->append(record.data(), record.size(), [this](error e) {
+                        if(e) std::cout << "append_writer failed: " << e.str() << std::endl;
+                        ++completed;
+                        issue();
+                    });
+                }
+                if(issued == records && completed == records) w->close();
+            }
+        } a;
+        a.w = fs::append_writer::create(log_file, false, 4096, 0);
+        a.record.assign(99, 'r');
+        a.record += '\n';
+        a.issued = a.completed = 0;
+
+        phase p("append_writer", records);
+        a.issue();
+        run();
+        p.done();
+        std::printf("%-16s %8zu groups\n", "", a.w->groups_written());
+    }
+
+    // walk: 64 directories of 32 files. One operation is one entry.
+    std::system(("rm -rf " + tree + " && mkdir -p " + tree).c_str());
+    for(int d = 0; d < 64; ++d)
+    {
+        auto sub = tree + "/d" + std::to_string(d);
+        std::system(("mkdir " + sub + " && cd " + sub + " && touch $(seq 1 32)").c_str());
+    }
+    for(int round = 0; round < 2; ++round)
+    {
+        auto entries = std::make_shared<std::size_t>(0);
+        auto p = std::make_shared<phase>("walk", 64 * 33);
+        fs::walk(tree, [entries](const std::string&, const fs::stats&) { ++*entries; }, [p, entries](error e) {
+            if(e) std::cout << "walk failed: " << e.str() << std::endl;
+            p->ops_ = *entries;
+            p->done();
+        });
+        run();
+    }
+
+    // stat, open and close, then read: one request after the other, so each one goes through the pooled
+    // create_req(). One operation is one stat + open + close, or one 4 KiB read. The read's std::string is
+    // the callback's argument: expect one allocation per read and none per request.
+    {
+        struct cycle
+        {
+            std::string path;
+            fs::file_handle fd;
+            std::size_t left;
+            std::shared_ptr<phase> p;
+
+            void stat_open_close()
+            {
+                if(!left--) return p->done();
+                fs::stat(path, [this](const fs::stats&, error e) {
+                    if(e) std::cout << "stat failed: " << e.str() << std::endl;
+                    fs::open(path, O_RDONLY, 0, [this](fs::file_handle f, error e) {
+                        if(e) std::cout << "open failed: " << e.str() << std::endl;
+                        fs::close(f, [this](error e) {
+                            if(e) std::cout << "close failed: " << e.str() << std::endl;
+                            stat_open_close();
+                        });
+                    });
+                });
+            }
+
+            void read()
+            {
+                if(!left--) return p->done();
+                fs::read(fd, chunk_size, 0, [this](const std::string&, error e) {
+                    if(e) std::cout << "read failed: " << e.str() << std::endl;
+                    read();
+                });
+            }
+        } c;
+        c.path = data_file;
+
+        const std::size_t cycles = 20000;
+        for(int round = 0; round < 2; ++round) // the first round warms up the pools
+        {
+            c.left = cycles;
+            c.p = std::make_shared<phase>("stat+open+close", cycles);
+            c.stat_open_close();
+            run();
+        }
+
+        c.fd = ::open(data_file.c_str(), O_RDONLY);
+        for(int round = 0; round < 2; ++round)
+        {
+            c.left = cycles;
+            c.p = std::make_shared<phase>("read", cycles);
+            c.read();
+            run();
+        }
+        ::close(c.fd);
+    }
+
+    std::remove(data_file.c_str());
+    std::remove(log_file.c_str());
+    std::system(("rm -rf " + tree).c_str());
+    return 0;
+}
@@ -28,6 +28,8 @@ namespace native
             uv_cid_shutdown,
             uv_cid_connect,
             uv_cid_connect6,
+            uv_cid_timer,
+            uv_cid_udp_recv,
             uv_cid_max
         };
     }
@@ -2,62 +2,112 @@
 #define __CALLBACK_H__
 
 #include "base.h"
+#include <new>
+#include <cstdlib>
+#include <type_traits>
 
 namespace native
 {
     namespace internal
     {
-        class callback_object_base
+        // one static per callback type: its address identifies the type without RTTI.
+        template<typename callback_t>
+        struct callback_type_tag
+        {
+            static const char id;
+        };
+
+        template<typename callback_t>
+        const char callback_type_tag<callback_t>::id = 0;
+
+        /*!
+         *  Type-erased storage for one callback object.
+         *  Objects up to the size of a std::function are kept inline, larger ones on the heap.
+         */
+        class callback_slot
         {
         public:
-            callback_object_base(void* data)
-                : data_(data)
+            static const std::size_t inline_size = sizeof(std::function<void()>);
+
+            callback_slot()
+                : storage_()
+                , object_(nullptr)
+                , tag_(nullptr)
+                , destroy_(nullptr)
+                , data_(nullptr)
             {
             }
-            virtual ~callback_object_base()
+
+            ~callback_slot()
             {
+                reset();
             }
 
-            void* get_data() { return data_; }
-
-        private:
-            void* data_;
-        };
-
-        // SCO: serialized callback object
-        template<typename callback_t>
-        class callback_object : public callback_object_base
-        {
         public:
-            callback_object(const callback_t& callback, void* data=nullptr)
-                : callback_object_base(data)
-                , callback_(callback)
+            template<typename callback_t>
+            void store(callback_t&& callback, void* data=nullptr)
             {
+                typedef typename std::decay<callback_t>::type object_t;
+
+                reset();
+                if(sizeof(object_t) <= inline_size && std::alignment_of<object_t>::value <= std::alignment_of<storage_t>::value)
+                {
+                    object_ = new(&storage_) object_t(std::forward<callback_t>(callback));
+                    destroy_ = [](void* p) { reinterpret_cast<object_t*>(p)->~object_t(); };
+                }
+                else
+                {
+                    object_ = new object_t(std::forward<callback_t>(callback));
+                    destroy_ = [](void* p) { delete reinterpret_cast<object_t*>(p); };
+                }
+                tag_ = &callback_type_tag<object_t>::id;
+                data_ = data;
             }
 
-            virtual ~callback_object()
+            // the tag is checked in release builds too (one compare): calling the object as another
+            // type would be undefined behaviour, so a mismatch aborts instead.
+            template<typename callback_t>
+            callback_t& get()
             {
+                if(tag_ != &callback_type_tag<callback_t>::id) std::abort();
+                return *reinterpret_cast<callback_t*>(object_);
             }
 
-        public:
-            template<typename ...A>
-            typename std::result_of<callback_t(A...)>::type invoke(A&& ... args)
+            void* get_data() { return data_; }
+
+            void reset()
             {
-                return callback_(std::forward<A>(args)...);
+                if(destroy_) destroy_(object_);
+                object_ = nullptr;
+                tag_ = nullptr;
+                destroy_ = nullptr;
+                data_ = nullptr;
             }
 
         private:
-            callback_t callback_;
+            callback_slot(const callback_slot&);
+            void operator =(const callback_slot&);
+
+        private:
+            typedef std::aligned_storage<inline_size>::type storage_t;
+
+            storage_t storage_;
+            void* object_;
+            const char* tag_;
+            void (*destroy_)(void*);
+            void* data_;
         };
     }
 
-    typedef std::shared_ptr<internal::callback_object_base> callback_object_ptr;
-
+    /*!
+     *  Callback slots of a handle, one per native::internal::uv_callback_id.
+     *  Allocated together with the uv handle (see native::internal::alloc_handle()), which points to it through its data field.
+     */
     class callbacks
     {
     public:
-        callbacks(int max_callbacks)
-            : lut_(max_callbacks)
+        callbacks()
+            : lut_()
         {
         }
         ~callbacks()
@@ -65,27 +115,29 @@ namespace native
         }
 
         template<typename callback_t>
-        static void store(void* target, int cid, const callback_t& callback, void* data=nullptr)
+        static void store(void* target, int cid, callback_t&& callback, void* data=nullptr)
         {
-            reinterpret_cast<callbacks*>(target)->lut_[cid] = callback_object_ptr(new internal::callback_object<callback_t>(callback, data));
+            reinterpret_cast<callbacks*>(target)->lut_[cid].store(std::forward<callback_t>(callback), data);
         }
 
         template<typename callback_t>
         static void* get_data(void* target, int cid)
         {
-            return reinterpret_cast<callbacks*>(target)->lut_[cid]->get_data();
+            return reinterpret_cast<callbacks*>(target)->lut_[cid].get_data();
         }
 
         template<typename callback_t, typename ...A>
         static typename std::result_of<callback_t(A...)>::type invoke(void* target, int cid, A&& ... args)
         {
-            auto x = dynamic_cast<internal::callback_object<callback_t>*>(reinterpret_cast<callbacks*>(target)->lut_[cid].get());
-            assert(x);
-            return x->invoke(std::forward<A>(args)...);
+            return reinterpret_cast<callbacks*>(target)->lut_[cid].get<callback_t>()(std::forward<A>(args)...);
         }
 
     private:
-        std::vector<callback_object_ptr> lut_;
+        callbacks(const callbacks&);
+        void operator =(const callbacks&);
+
+    private:
+        internal::callback_slot lut_[internal::uv_cid_max];
     };
 }
 
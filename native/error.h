@@ -2,6 +2,7 @@
 #define __ERROR_H__
 
 #include"base.h"
+#include <cerrno>
 
 namespace native
 {
@@ -41,6 +42,56 @@ namespace native
     };
 
     inline error get_last_error() { return uv_last_error(uv_default_loop()); }
+
+    namespace internal
+    {
+        // error for the errno of a system call made outside libuv, e.g. in a threadpool job.
+        inline uv_err_t sys_error(int sys_errno)
+        {
+            uv_err_code code = UV_UNKNOWN;
+            switch(sys_errno)
+            {
+                case 0: code = UV_OK; break;
+                case EACCES: code = UV_EACCES; break;
+                case EAGAIN: code = UV_EAGAIN; break;
+                case EBADF: code = UV_EBADF; break;
+                case EBUSY: code = UV_EBUSY; break;
+                case ECANCELED: code = UV_ECANCELED; break;
+                case ECONNREFUSED: code = UV_ECONNREFUSED; break;
+                case EEXIST: code = UV_EEXIST; break;
+                case EFAULT: code = UV_EFAULT; break;
+                case EHOSTUNREACH: code = UV_EHOSTUNREACH; break;
+                case EINTR: code = UV_EINTR; break;
+                case EINVAL: code = UV_EINVAL; break;
+                case EIO: code = UV_EIO; break;
+                case EISDIR: code = UV_EISDIR; break;
+                case ELOOP: code = UV_ELOOP; break;
+                case EMFILE: code = UV_EMFILE; break;
+                case EMSGSIZE: code = UV_EMSGSIZE; break;
+                case ENAMETOOLONG: code = UV_ENAMETOOLONG; break;
+                case ENETUNREACH: code = UV_ENETUNREACH; break;
+                case ENFILE: code = UV_ENFILE; break;
+                case ENOBUFS: code = UV_ENOBUFS; break;
+                case ENODEV: code = UV_ENODEV; break;
+                case ENOENT: code = UV_ENOENT; break;
+                case ENOMEM: code = UV_ENOMEM; break;
+                case ENOSPC: code = UV_ENOSPC; break;
+                case ENOSYS: code = UV_ENOSYS; break;
+                case ENOTDIR: code = UV_ENOTDIR; break;
+                case ENOTEMPTY: code = UV_ENOTEMPTY; break;
+                case ENOTSUP: code = UV_ENOTSUP; break;
+                case EPERM: code = UV_EPERM; break;
+                case EPIPE: code = UV_EPIPE; break;
+                case EROFS: code = UV_EROFS; break;
+                case ESPIPE: code = UV_ESPIPE; break;
+                case EXDEV: code = UV_EXDEV; break;
+                default: break;
+            }
+
+            uv_err_t e = { code, sys_errno };
+            return e;
+        }
+    }
 }
 
 
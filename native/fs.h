@@ -5,11 +5,24 @@
 #include <functional>
 #include <algorithm>
 #include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <climits>
+#include <cstring>
+#include <unistd.h>
+#include <deque>
 #include "callback.h"
+#include "loop.h"
+#include "error.h"
+#include "pool.h"
+#include "stream.h"
+#include "uring.h"
 
 namespace native
 {
-    // TODO: implement functions that accept loop pointer as extra argument.
+    class file;
+
     namespace fs
     {
         typedef uv_file file_handle;
@@ -30,70 +43,195 @@ namespace native
         static const int large_large = O_LARGEFILE;
 #endif
 
+        // madvise() hints for map() and mapped_file::advise()
+        static const int map_normal = 0;
+        static const int map_sequential = 1;
+        static const int map_random = 2;
+        static const int map_willneed = 4;
+        static const int map_hugepage = 8;
+
         namespace internal
         {
+            // uv_fs_t with inline storage for its callback (and the buffer of a read()).
+            // Requests are recycled through a per-loop pool: no allocation per operation.
+            struct fs_req
+            {
+                fs_req()
+                    : req()
+                    , slot()
+                    , buf(nullptr)
+                    , buf_size(0)
+                {}
+
+                uv_fs_t req;
+                native::internal::callback_slot slot;
+                char* buf;
+                std::size_t buf_size;
+#ifdef NATIVE_HAS_IO_URING
+                native::internal::uring_op op;
+                uv_fs_cb cb;
+                std::string path;
+#endif
+            };
+
+            typedef native::internal::object_pool<fs_req> fs_req_pool;
+
+            inline fs_req* get_fs_req(uv_fs_t* req)
+            {
+                return reinterpret_cast<fs_req*>(req);
+            }
+
             template<typename callback_t>
-            uv_fs_t* create_req(callback_t callback, void* data=nullptr)
+            uv_fs_t* create_req(uv_loop_t* loop, callback_t&& callback, void* data=nullptr)
             {
-                auto req = new uv_fs_t;
-                req->data = new callbacks(1);
-                assert(req->data);
-                callbacks::store(req->data, 0, callback, data);
+                auto r = native::internal::loop_local<fs_req_pool>(loop).acquire();
+                r->slot.store(std::forward<callback_t>(callback), data);
+                r->req.loop = loop;
+                r->req.data = nullptr;
+
+                return &r->req;
+            }
 
-                return req;
+            inline native::internal::callback_slot* get_slot(uv_fs_t* req)
+            {
+                return &get_fs_req(req)->slot;
             }
 
             template<typename callback_t, typename ...A>
             typename std::result_of<callback_t(A...)>::type invoke_from_req(uv_fs_t* req, A&& ... args)
             {
-                return callbacks::invoke<callback_t>(req->data, 0, std::forward<A>(args)...);
+                return get_slot(req)->get<callback_t>()(std::forward<A>(args)...);
             }
 
             template<typename callback_t, typename data_t>
             data_t* get_data_from_req(uv_fs_t* req)
             {
-                return reinterpret_cast<data_t*>(callbacks::get_data<callback_t>(req->data, 0));
+                return reinterpret_cast<data_t*>(get_slot(req)->get_data());
             }
 
-            template<typename callback_t, typename data_t>
-            void delete_req(uv_fs_t* req)
+            inline void delete_req(uv_fs_t* req)
             {
-                delete reinterpret_cast<data_t*>(callbacks::get_data<callback_t>(req->data, 0));
-                delete reinterpret_cast<callbacks*>(req->data);
+                auto r = get_fs_req(req);
+                auto loop = req->loop;
+                r->slot.reset();
+                if(r->buf)
+                {
+                    native::internal::loop_local<native::internal::buffer_pool>(loop).release(r->buf, r->buf_size);
+                    r->buf = nullptr;
+                    r->buf_size = 0;
+                }
                 uv_fs_req_cleanup(req);
-                delete req;
+                native::internal::loop_local<fs_req_pool>(loop).release(r);
             }
 
             template<typename callback_t, typename data_t>
-            void delete_req_arr_data(uv_fs_t* req)
+            void delete_req(uv_fs_t* req)
             {
-                delete[] reinterpret_cast<data_t*>(callbacks::get_data<callback_t>(req->data, 0));
-                delete reinterpret_cast<callbacks*>(req->data);
-                uv_fs_req_cleanup(req);
-                delete req;
+                delete reinterpret_cast<data_t*>(get_slot(req)->get_data());
+                delete_req(req);
             }
 
-            inline void delete_req(uv_fs_t* req)
+#ifdef NATIVE_HAS_IO_URING
+            // SQE of the loop's io_uring, or nullptr if the request must go to the threadpool.
+            inline io_uring_sqe* uring_sqe(uv_loop_t* loop, bool current_position=false)
             {
-                delete reinterpret_cast<callbacks*>(req->data);
-                uv_fs_req_cleanup(req);
-                delete req;
+                auto& ring = native::internal::loop_local<native::internal::uring>(loop);
+                if(!ring.available(loop) || (current_position && !ring.current_position())) return nullptr;
+                return ring.get_sqe();
+            }
+
+            // submits sqe for req: on completion, req is filled in as libuv would and passed to cb.
+            inline void uring_submit(uv_fs_t* req, io_uring_sqe* sqe, uv_fs_type type, uv_fs_cb cb)
+            {
+                auto r = get_fs_req(req);
+                r->req.fs_type = type;
+                r->req.result = 0;
+                r->req.errorno = UV_OK;
+                r->cb = cb;
+                r->op.data = r;
+                r->op.done = [](native::internal::uring_op* op, int res) {
+                    auto r = reinterpret_cast<fs_req*>(op->data);
+                    r->req.result = res < 0 ? -1 : res;
+                    if(res < 0) r->req.errorno = native::internal::sys_error(-res).code;
+                    r->cb(&r->req);
+                };
+                native::internal::loop_local<native::internal::uring>(req->loop).submit(sqe, &r->op);
             }
+#endif
 
+            // read_to_end(): the whole file is read into result, chunk_size bytes per uv_fs_read().
             struct rte_context
             {
                 fs::file_handle file;
-                const static int buflen = 32;
-                char buf[buflen];
+                std::size_t chunk_size;
+                std::size_t expected; // size from fstat(), 0 if unknown
+                std::size_t length; // bytes read so far
+                bool seekable; // regular file: positional reads, otherwise from the current position
                 std::string result;
             };
 
+            template<typename callback_t>
+            void rte_cb(uv_fs_t* req);
+
+            template<typename callback_t>
+            void rte_read_next(uv_fs_t* req)
+            {
+                // initial size of (and smallest growth step for) the buffer of a file of unknown size
+                const std::size_t min_unknown_size = 16 * 1024;
+
+                auto ctx = get_data_from_req<callback_t, rte_context>(req);
+                if(ctx->expected && ctx->length >= ctx->expected)
+                {
+                    // read as much as fstat() reported: done without one more read for EOF.
+                    invoke_from_req<callback_t>(req, ctx->result, error());
+                    delete_req<callback_t, rte_context>(req);
+                    return;
+                }
+
+                if(ctx->length == ctx->result.size())
+                {
+                    // unknown size (pipes, procfs, ...): grow geometrically.
+                    ctx->result.resize(std::max(ctx->result.size() * 2, min_unknown_size));
+                }
+
+                auto len = std::min(ctx->result.size() - ctx->length, ctx->chunk_size);
+                auto offset = ctx->seekable ? static_cast<off_t>(ctx->length) : -1;
+                if(uv_fs_read(req->loop, req, ctx->file, &ctx->result[ctx->length], len, offset, rte_cb<callback_t>))
+                {
+                    // failed to initiate uv_fs_read():
+                    invoke_from_req<callback_t>(req, std::string(), error(uv_last_error(req->loop)));
+                    delete_req<callback_t, rte_context>(req);
+                }
+            }
+
+            template<typename callback_t>
+            void rte_stat_cb(uv_fs_t* req)
+            {
+                assert(req->fs_type == UV_FS_FSTAT);
+
+                auto ctx = get_data_from_req<callback_t, rte_context>(req);
+                if(!req->errorno)
+                {
+                    auto st = reinterpret_cast<const uv_statbuf_t*>(req->ptr);
+                    ctx->seekable = S_ISREG(st->st_mode);
+                    if(ctx->seekable && st->st_size > 0)
+                    {
+                        // allocate the result once, at its final size
+                        ctx->expected = static_cast<std::size_t>(st->st_size);
+                        ctx->result.resize(ctx->expected);
+                    }
+                }
+
+                uv_fs_req_cleanup(req);
+                rte_read_next<callback_t>(req);
+            }
+
             template<typename callback_t>
             void rte_cb(uv_fs_t* req)
             {
                 assert(req->fs_type == UV_FS_READ);
 
-                auto ctx = reinterpret_cast<rte_context*>(callbacks::get_data<callback_t>(req->data, 0));
+                auto ctx = get_data_from_req<callback_t, rte_context>(req);
                 if(req->errorno)
                 {
                     // system error
@@ -103,295 +241,2167 @@ namespace native
                 else if(req->result == 0)
                 {
                     // EOF
+                    ctx->result.resize(ctx->length);
                     invoke_from_req<callback_t>(req, ctx->result, error());
                     delete_req<callback_t, rte_context>(req);
                 }
                 else
                 {
-                    ctx->result.append(std::string(ctx->buf, req->result));
-
+                    ctx->length += req->result;
                     uv_fs_req_cleanup(req);
-
-                    if(uv_fs_read(uv_default_loop(), req, ctx->file, ctx->buf, rte_context::buflen, ctx->result.length(), rte_cb<callback_t>))
-                    {
-                        // failed to initiate uv_fs_read():
-                        invoke_from_req<callback_t>(req, std::string(), error(uv_last_error(uv_default_loop())));
-                        delete_req<callback_t, rte_context>(req);
-                    }
+                    rte_read_next<callback_t>(req);
                 }
             }
         }
 
-        inline bool open(const std::string& path, int flags, int mode, std::function<void(native::fs::file_handle fd, error e)> callback)
+        // implementations, run on the given loop
+        namespace internal
         {
-            auto req = internal::create_req(callback);
-            if(uv_fs_open(uv_default_loop(), req, path.c_str(), flags, mode, [](uv_fs_t* req) {
-                assert(req->fs_type == UV_FS_OPEN);
+            inline bool open(uv_loop_t* loop, const std::string& path, int flags, int mode, std::function<void(native::fs::file_handle fd, error e)> callback)
+            {
+                auto req = create_req(loop, std::move(callback));
+                uv_fs_cb cb = [](uv_fs_t* req) {
+                    assert(req->fs_type == UV_FS_OPEN);
 
-                if(req->errorno) internal::invoke_from_req<decltype(callback)>(req, file_handle(-1), error(req->errorno));
-                else internal::invoke_from_req<decltype(callback)>(req, req->result, error(req->result<0?UV_ENOENT:UV_OK));
+                    if(req->errorno) invoke_from_req<decltype(callback)>(req, file_handle(-1), error(req->errorno));
+                    else invoke_from_req<decltype(callback)>(req, req->result, error(req->result<0?UV_ENOENT:UV_OK));
 
-                internal::delete_req(req);
-            })) {
-                // failed to initiate uv_fs_open()
-                internal::delete_req(req);
-                return false;
+                    delete_req(req);
+                };
+#ifdef NATIVE_HAS_IO_URING
+                if(auto sqe = uring_sqe(loop))
+                {
+                    auto r = get_fs_req(req);
+                    r->path = path; // must outlive the submission
+                    sqe->opcode = IORING_OP_OPENAT;
+                    sqe->flags = IOSQE_ASYNC; // the inline attempt is non-blocking: a FIFO would open without a writer
+                    sqe->fd = AT_FDCWD;
+                    sqe->addr = reinterpret_cast<uintptr_t>(r->path.c_str());
+                    sqe->open_flags = flags;
+                    sqe->len = mode;
+                    uring_submit(req, sqe, UV_FS_OPEN, cb);
+                    return true;
+                }
+#endif
+                if(uv_fs_open(loop, req, path.c_str(), flags, mode, cb)) {
+                    // failed to initiate uv_fs_open()
+                    delete_req(req);
+                    return false;
+                }
+                return true;
             }
-            return true;
-        }
 
-        inline bool read(file_handle fd, size_t len, off_t offset, std::function<void(const std::string& str, error e)> callback)
-        {
-            auto buf = new char[len];
-            auto req = internal::create_req(callback, buf);
-            if(uv_fs_read(uv_default_loop(), req, fd, buf, len, offset, [](uv_fs_t* req){
-                assert(req->fs_type == UV_FS_READ);
+            inline bool read(uv_loop_t* loop, file_handle fd, size_t len, off_t offset, std::function<void(const std::string& str, error e)> callback)
+            {
+                auto req = create_req(loop, std::move(callback));
+                auto r = get_fs_req(req);
+                auto& pool = native::internal::loop_local<native::internal::buffer_pool>(loop);
+                r->buf_size = std::max(len, pool.buffer_size()); // reads up to the pooled size share pooled buffers
+                r->buf = pool.acquire(r->buf_size);
+                uv_fs_cb cb = [](uv_fs_t* req){
+                    assert(req->fs_type == UV_FS_READ);
 
-                if(req->errorno)
+                    if(req->errorno)
+                    {
+                        // system error
+                        invoke_from_req<decltype(callback)>(req, std::string(), error(req->errorno));
+                    }
+                    else if(req->result == 0)
+                    {
+                        // EOF
+                        invoke_from_req<decltype(callback)>(req, std::string(), error(UV_EOF));
+                    }
+                    else
+                    {
+                        invoke_from_req<decltype(callback)>(req, std::string(get_fs_req(req)->buf, req->result), error());
+                    }
+
+                    delete_req(req);
+                };
+#ifdef NATIVE_HAS_IO_URING
+                if(auto sqe = uring_sqe(loop, offset < 0))
                 {
-                    // system error
-                    internal::invoke_from_req<decltype(callback)>(req, std::string(), error(req->errorno));
+                    sqe->opcode = IORING_OP_READ;
+                    sqe->fd = fd;
+                    sqe->addr = reinterpret_cast<uintptr_t>(r->buf);
+                    sqe->len = static_cast<uint32_t>(std::min<size_t>(len, INT_MAX));
+                    sqe->off = offset < 0 ? static_cast<uint64_t>(-1) : static_cast<uint64_t>(offset);
+                    uring_submit(req, sqe, UV_FS_READ, cb);
+                    return true;
                 }
-                else if(req->result == 0)
+#endif
+                if(uv_fs_read(loop, req, fd, r->buf, len, offset, cb)) {
+                    // failed to initiate uv_fs_read()
+                    delete_req(req);
+                    return false;
+                }
+                return true;
+            }
+
+            inline bool write(uv_loop_t* loop, file_handle fd, const char* buf, size_t len, off_t offset, std::function<void(int nwritten, error e)> callback)
+            {
+                auto req = create_req(loop, std::move(callback));
+
+                uv_fs_cb cb = [](uv_fs_t* req){
+                    assert(req->fs_type == UV_FS_WRITE);
+
+                    if(req->errorno)
+                    {
+                        invoke_from_req<decltype(callback)>(req, 0, error(req->errorno));
+                    }
+                    else
+                    {
+                        invoke_from_req<decltype(callback)>(req, req->result, error());
+                    }
+
+                    delete_req(req);
+                };
+#ifdef NATIVE_HAS_IO_URING
+                if(auto sqe = uring_sqe(loop, offset < 0))
                 {
-                    // EOF
-                    internal::invoke_from_req<decltype(callback)>(req, std::string(), error(UV_EOF));
+                    sqe->opcode = IORING_OP_WRITE;
+                    sqe->fd = fd;
+                    sqe->addr = reinterpret_cast<uintptr_t>(buf);
+                    sqe->len = static_cast<uint32_t>(std::min<size_t>(len, INT_MAX));
+                    sqe->off = offset < 0 ? static_cast<uint64_t>(-1) : static_cast<uint64_t>(offset);
+                    uring_submit(req, sqe, UV_FS_WRITE, cb);
+                    return true;
                 }
-                else
+#endif
+                // TODO: const_cast<> !!
+                if(uv_fs_write(loop, req, fd, const_cast<char*>(buf), len, offset, cb)) {
+                    // failed to initiate uv_fs_write()
+                    delete_req(req);
+                    return false;
+                }
+                return true;
+            }
+
+            inline bool read_to_end(uv_loop_t* loop, file_handle fd, std::function<void(const std::string& str, error e)> callback, std::size_t chunk_size)
+            {
+                auto ctx = new rte_context;
+                ctx->file = fd;
+                ctx->chunk_size = std::max<std::size_t>(chunk_size, 1);
+                ctx->expected = 0;
+                ctx->length = 0;
+                ctx->seekable = true;
+                auto req = create_req(loop, std::move(callback), ctx);
+
+                // fstat() first to size the result, then read.
+                if(uv_fs_fstat(loop, req, fd, rte_stat_cb<decltype(callback)>)) {
+                    // failed to initiate uv_fs_fstat()
+                    delete_req<decltype(callback), rte_context>(req);
+                    return false;
+                }
+                return true;
+            }
+
+            inline bool close(uv_loop_t* loop, file_handle fd, std::function<void(error e)> callback)
+            {
+                auto req = create_req(loop, std::move(callback));
+                uv_fs_cb cb = [](uv_fs_t* req){
+                    assert(req->fs_type == UV_FS_CLOSE);
+                    invoke_from_req<decltype(callback)>(req, req->errorno?error(req->errorno):error());
+                    delete_req(req);
+                };
+#ifdef NATIVE_HAS_IO_URING
+                if(auto sqe = uring_sqe(loop))
                 {
-                    auto buf = internal::get_data_from_req<decltype(callback), char>(req);
-                    internal::invoke_from_req<decltype(callback)>(req, std::string(buf, req->result), error());
+                    sqe->opcode = IORING_OP_CLOSE;
+                    sqe->fd = fd;
+                    uring_submit(req, sqe, UV_FS_CLOSE, cb);
+                    return true;
+                }
+#endif
+                if(uv_fs_close(loop, req, fd, cb)) {
+                    delete_req(req);
+                    return false;
                 }
+                return true;
+            }
 
-                internal::delete_req_arr_data<decltype(callback), char>(req);
-            })) {
-                // failed to initiate uv_fs_read()
-                internal::delete_req_arr_data<decltype(callback), char>(req);
-                return false;
+            inline bool unlink(uv_loop_t* loop, const std::string& path, std::function<void(error e)> callback)
+            {
+                auto req = create_req(loop, std::move(callback));
+                if(uv_fs_unlink(loop, req, path.c_str(), [](uv_fs_t* req){
+                    assert(req->fs_type == UV_FS_UNLINK);
+                    invoke_from_req<decltype(callback)>(req, req->errorno?error(req->errorno):error());
+                    delete_req(req);
+                })) {
+                    delete_req(req);
+                    return false;
+                }
+                return true;
             }
-            return true;
-        }
 
-        inline bool write(file_handle fd, const char* buf, size_t len, off_t offset, std::function<void(int nwritten, error e)> callback)
-        {
-            auto req = internal::create_req(callback);
+            inline bool mkdir(uv_loop_t* loop, const std::string& path, int mode, std::function<void(error e)> callback)
+            {
+                auto req = create_req(loop, std::move(callback));
+                if(uv_fs_mkdir(loop, req, path.c_str(), mode, [](uv_fs_t* req){
+                    assert(req->fs_type == UV_FS_MKDIR);
+                    invoke_from_req<decltype(callback)>(req, req->errorno?error(req->errorno):error());
+                    delete_req(req);
+                })) {
+                    delete_req(req);
+                    return false;
+                }
+                return true;
+            }
 
-            // TODO: const_cast<> !!
-            if(uv_fs_write(uv_default_loop(), req, fd, const_cast<char*>(buf), len, offset, [](uv_fs_t* req){
-                assert(req->fs_type == UV_FS_WRITE);
+            inline bool rmdir(uv_loop_t* loop, const std::string& path, std::function<void(error e)> callback)
+            {
+                auto req = create_req(loop, std::move(callback));
+                if(uv_fs_rmdir(loop, req, path.c_str(), [](uv_fs_t* req){
+                    assert(req->fs_type == UV_FS_RMDIR);
+                    invoke_from_req<decltype(callback)>(req, req->errorno?error(req->errorno):error());
+                    delete_req(req);
+                })) {
+                    delete_req(req);
+                    return false;
+                }
+                return true;
+            }
 
-                if(req->errorno)
-                {
-                    internal::invoke_from_req<decltype(callback)>(req, 0, error(req->errorno));
+            inline bool rename(uv_loop_t* loop, const std::string& path, const std::string& new_path, std::function<void(error e)> callback)
+            {
+                auto req = create_req(loop, std::move(callback));
+                if(uv_fs_rename(loop, req, path.c_str(), new_path.c_str(), [](uv_fs_t* req){
+                    assert(req->fs_type == UV_FS_RENAME);
+                    invoke_from_req<decltype(callback)>(req, req->errorno?error(req->errorno):error());
+                    delete_req(req);
+                })) {
+                    delete_req(req);
+                    return false;
                 }
-                else
-                {
-                    internal::invoke_from_req<decltype(callback)>(req, req->result, error());
+                return true;
+            }
+
+            inline bool chmod(uv_loop_t* loop, const std::string& path, int mode, std::function<void(error e)> callback)
+            {
+                auto req = create_req(loop, std::move(callback));
+                if(uv_fs_chmod(loop, req, path.c_str(), mode, [](uv_fs_t* req){
+                    assert(req->fs_type == UV_FS_CHMOD);
+                    invoke_from_req<decltype(callback)>(req, req->errorno?error(req->errorno):error());
+                    delete_req(req);
+                })) {
+                    delete_req(req);
+                    return false;
                 }
+                return true;
+            }
 
-                internal::delete_req(req);
-            })) {
-                // failed to initiate uv_fs_write()
-                internal::delete_req(req);
-                return false;
+            inline bool chown(uv_loop_t* loop, const std::string& path, int uid, int gid, std::function<void(error e)> callback)
+            {
+                auto req = create_req(loop, std::move(callback));
+                if(uv_fs_chown(loop, req, path.c_str(), uid, gid, [](uv_fs_t* req){
+                    assert(req->fs_type == UV_FS_CHOWN);
+                    invoke_from_req<decltype(callback)>(req, req->errorno?error(req->errorno):error());
+                    delete_req(req);
+                })) {
+                    delete_req(req);
+                    return false;
+                }
+                return true;
             }
-            return true;
         }
 
-        inline bool read_to_end(file_handle fd, std::function<void(const std::string& str, error e)> callback)
+        inline bool open(const std::string& path, int flags, int mode, std::function<void(native::fs::file_handle fd, error e)> callback)
         {
-            auto ctx = new internal::rte_context;
-            ctx->file = fd;
-            auto req = internal::create_req(callback, ctx);
+            return internal::open(uv_default_loop(), path, flags, mode, std::move(callback));
+        }
 
-            if(uv_fs_read(uv_default_loop(), req, fd, ctx->buf, internal::rte_context::buflen, 0, internal::rte_cb<decltype(callback)>)) {
-                // failed to initiate uv_fs_read()
-                internal::delete_req<decltype(callback), internal::rte_context>(req);
-                return false;
-            }
-            return true;
+        inline bool open(native::loop& l, const std::string& path, int flags, int mode, std::function<void(native::fs::file_handle fd, error e)> callback)
+        {
+            return internal::open(l.get(), path, flags, mode, std::move(callback));
+        }
+
+        inline bool read(file_handle fd, size_t len, off_t offset, std::function<void(const std::string& str, error e)> callback)
+        {
+            return internal::read(uv_default_loop(), fd, len, offset, std::move(callback));
+        }
+
+        inline bool read(native::loop& l, file_handle fd, size_t len, off_t offset, std::function<void(const std::string& str, error e)> callback)
+        {
+            return internal::read(l.get(), fd, len, offset, std::move(callback));
+        }
+
+        inline bool write(file_handle fd, const char* buf, size_t len, off_t offset, std::function<void(int nwritten, error e)> callback)
+        {
+            return internal::write(uv_default_loop(), fd, buf, len, offset, std::move(callback));
+        }
+
+        inline bool write(native::loop& l, file_handle fd, const char* buf, size_t len, off_t offset, std::function<void(int nwritten, error e)> callback)
+        {
+            return internal::write(l.get(), fd, buf, len, offset, std::move(callback));
+        }
+
+        static const std::size_t default_read_chunk_size = 1024 * 1024;
+
+        /*!
+         *  Reads the whole file from offset 0. Regular files are fstat()'d first so that the result is
+         *  allocated once; files of unknown size (pipes, procfs, ...) grow the result geometrically.
+         *  Each uv_fs_read() reads at most chunk_size bytes.
+         */
+        inline bool read_to_end(file_handle fd, std::function<void(const std::string& str, error e)> callback, std::size_t chunk_size=default_read_chunk_size)
+        {
+            return internal::read_to_end(uv_default_loop(), fd, std::move(callback), chunk_size);
+        }
+
+        inline bool read_to_end(native::loop& l, file_handle fd, std::function<void(const std::string& str, error e)> callback, std::size_t chunk_size=default_read_chunk_size)
+        {
+            return internal::read_to_end(l.get(), fd, std::move(callback), chunk_size);
         }
 
         inline bool close(file_handle fd, std::function<void(error e)> callback)
         {
-            auto req = internal::create_req(callback);
-            if(uv_fs_close(uv_default_loop(), req, fd, [](uv_fs_t* req){
-                assert(req->fs_type == UV_FS_CLOSE);
-                internal::invoke_from_req<decltype(callback)>(req, req->errorno?error(req->errorno):error());
-                internal::delete_req(req);
-            })) {
-                internal::delete_req(req);
-                return false;
-            }
-            return true;
+            return internal::close(uv_default_loop(), fd, std::move(callback));
+        }
+
+        inline bool close(native::loop& l, file_handle fd, std::function<void(error e)> callback)
+        {
+            return internal::close(l.get(), fd, std::move(callback));
         }
 
         inline bool unlink(const std::string& path, std::function<void(error e)> callback)
         {
-            auto req = internal::create_req(callback);
-            if(uv_fs_unlink(uv_default_loop(), req, path.c_str(), [](uv_fs_t* req){
-                assert(req->fs_type == UV_FS_UNLINK);
-                internal::invoke_from_req<decltype(callback)>(req, req->errorno?error(req->errorno):error());
-                internal::delete_req(req);
-            })) {
-                internal::delete_req(req);
-                return false;
-            }
-            return true;
+            return internal::unlink(uv_default_loop(), path, std::move(callback));
+        }
+
+        inline bool unlink(native::loop& l, const std::string& path, std::function<void(error e)> callback)
+        {
+            return internal::unlink(l.get(), path, std::move(callback));
         }
 
         inline bool mkdir(const std::string& path, int mode, std::function<void(error e)> callback)
         {
-            auto req = internal::create_req(callback);
-            if(uv_fs_mkdir(uv_default_loop(), req, path.c_str(), mode, [](uv_fs_t* req){
-                assert(req->fs_type == UV_FS_MKDIR);
-                internal::invoke_from_req<decltype(callback)>(req, req->errorno?error(req->errorno):error());
-                internal::delete_req(req);
-            })) {
-                internal::delete_req(req);
-                return false;
-            }
-            return true;
+            return internal::mkdir(uv_default_loop(), path, mode, std::move(callback));
+        }
+
+        inline bool mkdir(native::loop& l, const std::string& path, int mode, std::function<void(error e)> callback)
+        {
+            return internal::mkdir(l.get(), path, mode, std::move(callback));
         }
 
         inline bool rmdir(const std::string& path, std::function<void(error e)> callback)
         {
-            auto req = internal::create_req(callback);
-            if(uv_fs_rmdir(uv_default_loop(), req, path.c_str(), [](uv_fs_t* req){
-                assert(req->fs_type == UV_FS_RMDIR);
-                internal::invoke_from_req<decltype(callback)>(req, req->errorno?error(req->errorno):error());
-                internal::delete_req(req);
-            })) {
-                internal::delete_req(req);
-                return false;
-            }
-            return true;
+            return internal::rmdir(uv_default_loop(), path, std::move(callback));
+        }
+
+        inline bool rmdir(native::loop& l, const std::string& path, std::function<void(error e)> callback)
+        {
+            return internal::rmdir(l.get(), path, std::move(callback));
         }
 
         inline bool rename(const std::string& path, const std::string& new_path, std::function<void(error e)> callback)
         {
-            auto req = internal::create_req(callback);
-            if(uv_fs_rename(uv_default_loop(), req, path.c_str(), new_path.c_str(), [](uv_fs_t* req){
-                assert(req->fs_type == UV_FS_RENAME);
-                internal::invoke_from_req<decltype(callback)>(req, req->errorno?error(req->errorno):error());
-                internal::delete_req(req);
-            })) {
-                internal::delete_req(req);
-                return false;
-            }
-            return true;
+            return internal::rename(uv_default_loop(), path, new_path, std::move(callback));
+        }
+
+        inline bool rename(native::loop& l, const std::string& path, const std::string& new_path, std::function<void(error e)> callback)
+        {
+            return internal::rename(l.get(), path, new_path, std::move(callback));
         }
 
         inline bool chmod(const std::string& path, int mode, std::function<void(error e)> callback)
         {
-            auto req = internal::create_req(callback);
-            if(uv_fs_chmod(uv_default_loop(), req, path.c_str(), mode, [](uv_fs_t* req){
-                assert(req->fs_type == UV_FS_CHMOD);
-                internal::invoke_from_req<decltype(callback)>(req, req->errorno?error(req->errorno):error());
-                internal::delete_req(req);
-            })) {
-                internal::delete_req(req);
-                return false;
-            }
-            return true;
+            return internal::chmod(uv_default_loop(), path, mode, std::move(callback));
+        }
+
+        inline bool chmod(native::loop& l, const std::string& path, int mode, std::function<void(error e)> callback)
+        {
+            return internal::chmod(l.get(), path, mode, std::move(callback));
         }
 
         inline bool chown(const std::string& path, int uid, int gid, std::function<void(error e)> callback)
         {
-            auto req = internal::create_req(callback);
-            if(uv_fs_chown(uv_default_loop(), req, path.c_str(), uid, gid, [](uv_fs_t* req){
-                assert(req->fs_type == UV_FS_CHOWN);
-                internal::invoke_from_req<decltype(callback)>(req, req->errorno?error(req->errorno):error());
-                internal::delete_req(req);
-            })) {
-                internal::delete_req(req);
-                return false;
-            }
-            return true;
+            return internal::chown(uv_default_loop(), path, uid, gid, std::move(callback));
         }
 
-#if 0
-        bool readdir(const std::string& path, int flags, std::function<void(error e)> callback)
+        inline bool chown(native::loop& l, const std::string& path, int uid, int gid, std::function<void(error e)> callback)
         {
-            auto req = internal::create_req(callback);
-            if(uv_fs_readdir(uv_default_loop(), req, path.c_str(), flags, [](uv_fs_t* req){
-                assert(req->fs_type == UV_FS_READDIR);
-                internal::invoke_from_req<decltype(callback)>(req, req->errorno?error(req->errorno):error());
-                internal::delete_req(req);
-            })) {
-                internal::delete_req(req);
-                return false;
-            }
-            return true;
+            return internal::chown(l.get(), path, uid, gid, std::move(callback));
         }
 
-        bool stat(const std::string& path, std::function<void(error e)> callback)
+        namespace internal
         {
-            auto req = internal::create_req(callback);
-            if(uv_fs_stat(uv_default_loop(), req, path.c_str(), [](uv_fs_t* req){
-                assert(req->fs_type == UV_FS_STAT);
-                internal::invoke_from_req<decltype(callback)>(req, req->errorno?error(req->errorno):error());
-                internal::delete_req(req);
-            })) {
-                internal::delete_req(req);
-                return false;
-            }
-            return true;
+            struct map_request;
         }
 
-        bool fstat(const std::string& path, std::function<void(error e)> callback)
+        /*!
+         *  Read-only shared mapping of a whole file, created by fs::map().
+         *  The memory is unmapped when the last reference goes away.
+         */
+        class mapped_file
         {
-            auto req = internal::create_req(callback);
-            if(uv_fs_fstat(uv_default_loop(), req, path.c_str(), [](uv_fs_t* req){
-                assert(req->fs_type == UV_FS_FSTAT);
-                internal::invoke_from_req<decltype(callback)>(req, req->errorno?error(req->errorno):error());
-                internal::delete_req(req);
-            })) {
-                internal::delete_req(req);
-                return false;
+            friend struct internal::map_request;
+
+        public:
+            ~mapped_file()
+            {
+                if(data_) ::munmap(data_, size_);
             }
-            return true;
-        }
+
+        public:
+            const char* data() const { return static_cast<const char*>(data_); }
+            std::size_t size() const { return size_; }
+
+            /*!
+             *  Applies madvise() hints (map_sequential, map_willneed, ...) to the whole mapping.
+             */
+            bool advise(int hints)
+            {
+                return advise(data_, size_, hints);
+            }
+
+        private:
+            mapped_file(void* data, std::size_t size)
+                : data_(data)
+                , size_(size)
+            {}
+
+            mapped_file(const mapped_file&);
+            void operator =(const mapped_file&);
+
+            static bool advise(void* data, std::size_t size, int hints)
+            {
+                if(!data) return true;
+
+                bool ok = true;
+                if(hints & map_sequential) ok = ::madvise(data, size, MADV_SEQUENTIAL) == 0 && ok;
+                if(hints & map_random) ok = ::madvise(data, size, MADV_RANDOM) == 0 && ok;
+                if(hints & map_willneed) ok = ::madvise(data, size, MADV_WILLNEED) == 0 && ok;
+#ifdef MADV_HUGEPAGE
+                if(hints & map_hugepage) ok = ::madvise(data, size, MADV_HUGEPAGE) == 0 && ok;
 #endif
-    }
+                if(!hints) ok = ::madvise(data, size, MADV_NORMAL) == 0;
+                return ok;
+            }
 
-    class file
-    {
-    public:
-        static bool read(const std::string& path, std::function<void(const std::string& str, error e)> callback)
+        private:
+            void* data_;
+            std::size_t size_;
+        };
+
+        typedef std::shared_ptr<mapped_file> mapped_file_ptr;
+
+        namespace internal
         {
-            return fs::open(path.c_str(), fs::read_only, 0, [=](fs::file_handle fd, error e) {
-                if(e)
-                {
-                    callback(std::string(), e);
-                }
-                else
+            // open() + fstat() + mmap() as one threadpool job
+            struct map_request
+            {
+                uv_work_t req;
+                std::string path;
+                int hints;
+                void* data;
+                std::size_t size;
+                int sys_errno;
+                std::function<void(mapped_file_ptr file, error e)> callback;
+
+                static void work(uv_work_t* r)
                 {
-                    if(!fs::read_to_end(fd, callback))
+                    auto x = reinterpret_cast<map_request*>(r->data);
+                    int fd = ::open(x->path.c_str(), O_RDONLY | O_CLOEXEC);
+                    if(fd < 0)
                     {
-                        // failed to initiate read_to_end()
-                        callback(std::string(), error(uv_last_error(uv_default_loop())));
+                        x->sys_errno = errno;
+                        return;
                     }
-                }
-            });
-        }
 
-        static bool write(const std::string& path, const std::string& str, std::function<void(int nwritten, error e)> callback)
-        {
-            return fs::open(path.c_str(), fs::write_only|fs::create, 0664, [=](fs::file_handle fd, error e) {
-                if(e)
-                {
-                    callback(0, e);
-                }
-                else
-                {
-                    if(!fs::write(fd, str.c_str(), str.length(), 0, callback))
+                    struct stat st;
+                    if(::fstat(fd, &st) != 0) x->sys_errno = errno;
+                    else if(S_ISDIR(st.st_mode)) x->sys_errno = EISDIR;
+                    else if(st.st_size > 0)
                     {
-                        // failed to initiate read_to_end()
-                        callback(0, error(uv_last_error(uv_default_loop())));
+                        x->size = static_cast<std::size_t>(st.st_size);
+                        auto p = ::mmap(nullptr, x->size, PROT_READ, MAP_SHARED, fd, 0);
+                        if(p == MAP_FAILED) x->sys_errno = errno;
+                        else
+                        {
+                            x->data = p;
+                            // hints are best effort
+                            if(x->hints) mapped_file::advise(x->data, x->size, x->hints);
+                        }
                     }
+                    ::close(fd);
                 }
-            });
+
+                static void after_work(uv_work_t* r, int status)
+                {
+                    std::unique_ptr<map_request> x(reinterpret_cast<map_request*>(r->data));
+                    if(status) x->sys_errno = ECANCELED;
+
+                    if(x->sys_errno)
+                    {
+                        if(x->data) ::munmap(x->data, x->size);
+                        x->callback(nullptr, error(native::internal::sys_error(x->sys_errno)));
+                    }
+                    else
+                    {
+                        mapped_file_ptr file(new mapped_file(x->data, x->data ? x->size : 0));
+                        x->callback(file, error());
+                    }
+                }
+            };
+
+            inline bool map(uv_loop_t* loop, const std::string& path, std::function<void(mapped_file_ptr file, error e)> callback, int hints)
+            {
+                auto x = new map_request;
+                x->req.data = x;
+                x->path = path;
+                x->hints = hints;
+                x->data = nullptr;
+                x->size = 0;
+                x->sys_errno = 0;
+                x->callback = std::move(callback);
+
+                if(uv_queue_work(loop, &x->req, map_request::work, map_request::after_work))
+                {
+                    delete x;
+                    return false;
+                }
+                return true;
+            }
+        }
+
+        /*!
+         *  Maps the whole file read-only. open(), fstat() and mmap() run in the threadpool;
+         *  hints are madvise() flags (map_sequential, map_willneed, map_hugepage, ...).
+         *  The mapping can be sent over a stream without a copy:
+         *      s.write(file->data(), file->size(), file, callback);
+         */
+        inline bool map(const std::string& path, std::function<void(mapped_file_ptr file, error e)> callback, int hints=map_normal)
+        {
+            return internal::map(uv_default_loop(), path, std::move(callback), hints);
+        }
+
+        inline bool map(native::loop& l, const std::string& path, std::function<void(mapped_file_ptr file, error e)> callback, int hints=map_normal)
+        {
+            return internal::map(l.get(), path, std::move(callback), hints);
+        }
+
+        /*!
+         *  One part of a read_batch()/write_batch(): len bytes at offset in the file, read into (written from) buf.
+         *  result receives the bytes transferred, short at EOF for a read, or -1 if the extent failed.
+         */
+        struct extent
+        {
+            extent()
+                : offset(0)
+                , buf(nullptr)
+                , len(0)
+                , result(0)
+            {}
+
+            extent(off_t offset, char* buf, std::size_t len)
+                : offset(offset)
+                , buf(buf)
+                , len(len)
+                , result(0)
+            {}
+
+            off_t offset;
+            char* buf;
+            std::size_t len;
+            ssize_t result;
+        };
+
+        namespace internal
+        {
+            // read_batch()/write_batch() as one threadpool job: extents are sorted by offset and adjacent ones
+            // merged into a single preadv()/pwritev(), short transfers being resumed.
+            struct batch_request
+            {
+                uv_work_t req;
+                file_handle fd;
+                bool write;
+                std::vector<extent> extents;
+                int sys_errno; // first error
+                std::function<void(std::vector<extent>& extents, error e)> callback;
+
+                static ssize_t transfer(int fd, const iovec* iov, int count, off_t offset, bool write)
+                {
+#if defined(__APPLE__)
+                    // no preadv()/pwritev() before macOS 11: one buffer at a time, the caller resumes.
+                    count = 1;
+                    return write ? ::pwrite(fd, iov->iov_base, iov->iov_len, offset) : ::pread(fd, iov->iov_base, iov->iov_len, offset);
+#else
+                    return write ? ::pwritev(fd, iov, count, offset) : ::preadv(fd, iov, count, offset);
+#endif
+                }
+
+                // transfers the run of adjacent extents [first, last) of order; returns the bytes done.
+                std::size_t run(const std::vector<std::size_t>& order, std::size_t first, std::size_t last, int& err)
+                {
+#ifdef IOV_MAX
+                    const std::size_t max_iov = IOV_MAX;
+#else
+                    const std::size_t max_iov = 1024;
+#endif
+                    auto base = extents[order[first]].offset;
+                    std::size_t total = 0;
+                    for(auto i = first; i < last; ++i) total += extents[order[i]].len;
+
+                    std::vector<iovec> iov;
+                    std::size_t done = 0;
+                    while(done < total)
+                    {
+                        // buffers from position done on
+                        iov.clear();
+                        std::size_t skip = done;
+                        for(auto i = first; i < last && iov.size() < max_iov; ++i)
+                        {
+                            auto& x = extents[order[i]];
+                            if(skip >= x.len)
+                            {
+                                skip -= x.len;
+                                continue;
+                            }
+                            iov.push_back(iovec { x.buf + skip, x.len - skip });
+                            skip = 0;
+                        }
+
+                        auto n = transfer(fd, &iov[0], static_cast<int>(iov.size()), base + static_cast<off_t>(done), write);
+                        if(n < 0)
+                        {
+                            if(errno == EINTR) continue;
+                            err = errno;
+                            break;
+                        }
+                        if(n == 0)
+                        {
+                            if(write) err = EIO;
+                            break; // EOF
+                        }
+                        done += static_cast<std::size_t>(n);
+                    }
+                    return done;
+                }
+
+                static void work(uv_work_t* r)
+                {
+                    auto x = reinterpret_cast<batch_request*>(r->data);
+
+                    std::vector<std::size_t> order(x->extents.size());
+                    for(std::size_t i = 0; i < order.size(); ++i) order[i] = i;
+                    std::stable_sort(order.begin(), order.end(), [x](std::size_t a, std::size_t b) {
+                        return x->extents[a].offset < x->extents[b].offset;
+                    });
+
+                    for(std::size_t first = 0; first < order.size();)
+                    {
+                        auto last = first + 1;
+                        while(last < order.size())
+                        {
+                            auto& prev = x->extents[order[last-1]];
+                            if(prev.offset + static_cast<off_t>(prev.len) != x->extents[order[last]].offset) break;
+                            ++last;
+                        }
+
+                        int err = 0;
+                        auto done = x->run(order, first, last, err);
+                        for(auto i = first; i < last; ++i)
+                        {
+                            auto& e = x->extents[order[i]];
+                            auto n = std::min(done, e.len);
+                            done -= n;
+                            e.result = (err && n < e.len) ? -1 : static_cast<ssize_t>(n);
+                        }
+                        if(err && !x->sys_errno) x->sys_errno = err;
+                        first = last;
+                    }
+                }
+
+                static void after_work(uv_work_t* r, int status)
+                {
+                    std::unique_ptr<batch_request> x(reinterpret_cast<batch_request*>(r->data));
+                    if(status) x->sys_errno = ECANCELED;
+                    x->callback(x->extents, x->sys_errno ? error(native::internal::sys_error(x->sys_errno)) : error());
+                }
+            };
+
+            inline bool batch(uv_loop_t* loop, file_handle fd, bool write, std::vector<extent> extents, std::function<void(std::vector<extent>& extents, error e)> callback)
+            {
+                auto x = new batch_request;
+                x->req.data = x;
+                x->fd = fd;
+                x->write = write;
+                x->extents = std::move(extents);
+                x->sys_errno = 0;
+                x->callback = std::move(callback);
+
+                if(uv_queue_work(loop, &x->req, batch_request::work, batch_request::after_work))
+                {
+                    delete x;
+                    return false;
+                }
+                return true;
+            }
+        }
+
+        /*!
+         *  Reads all extents as one threadpool job with a single completion: adjacent extents are read
+         *  with one preadv(). The buffers must stay valid until the callback, which gets the extents back
+         *  with their results and the first error, if any.
+         */
+        inline bool read_batch(file_handle fd, std::vector<extent> extents, std::function<void(std::vector<extent>& extents, error e)> callback)
+        {
+            return internal::batch(uv_default_loop(), fd, false, std::move(extents), std::move(callback));
+        }
+
+        inline bool read_batch(native::loop& l, file_handle fd, std::vector<extent> extents, std::function<void(std::vector<extent>& extents, error e)> callback)
+        {
+            return internal::batch(l.get(), fd, false, std::move(extents), std::move(callback));
+        }
+
+        /*!
+         *  Writes all extents as one threadpool job, adjacent ones with one pwritev(); see read_batch().
+         *  Extents must not overlap.
+         */
+        inline bool write_batch(file_handle fd, std::vector<extent> extents, std::function<void(std::vector<extent>& extents, error e)> callback)
+        {
+            return internal::batch(uv_default_loop(), fd, true, std::move(extents), std::move(callback));
+        }
+
+        inline bool write_batch(native::loop& l, file_handle fd, std::vector<extent> extents, std::function<void(std::vector<extent>& extents, error e)> callback)
+        {
+            return internal::batch(l.get(), fd, true, std::move(extents), std::move(callback));
+        }
+
+        /*!
+         *  Result of stat(), lstat() and fstat().
+         */
+        struct stats
+        {
+            stats()
+                : dev(0), ino(0), mode(0), nlink(0), uid(0), gid(0), rdev(0)
+                , size(0), blksize(0), blocks(0), atime(0), mtime(0), ctime(0)
+            {}
+
+            explicit stats(const uv_statbuf_t& st)
+                : dev(st.st_dev), ino(st.st_ino), mode(st.st_mode), nlink(st.st_nlink), uid(st.st_uid), gid(st.st_gid), rdev(st.st_rdev)
+                , size(st.st_size), blksize(st.st_blksize), blocks(st.st_blocks), atime(st.st_atime), mtime(st.st_mtime), ctime(st.st_ctime)
+            {}
+
+            bool is_file() const { return S_ISREG(mode); }
+            bool is_directory() const { return S_ISDIR(mode); }
+            bool is_symlink() const { return S_ISLNK(mode); }
+            bool is_fifo() const { return S_ISFIFO(mode); }
+            bool is_socket() const { return S_ISSOCK(mode); }
+
+            uint64_t dev;
+            uint64_t ino;
+            unsigned int mode;
+            uint64_t nlink;
+            unsigned int uid;
+            unsigned int gid;
+            uint64_t rdev;
+            int64_t size;
+            int64_t blksize;
+            int64_t blocks;
+            time_t atime;
+            time_t mtime;
+            time_t ctime;
+        };
+
+        // walk(): number of readdir()/lstat() requests kept in flight
+        static const std::size_t default_walk_concurrency = 64;
+
+        namespace internal
+        {
+            template<typename callback_t>
+            void stat_cb(uv_fs_t* req)
+            {
+                assert(req->fs_type == UV_FS_STAT || req->fs_type == UV_FS_LSTAT || req->fs_type == UV_FS_FSTAT);
+
+                if(req->errorno) invoke_from_req<callback_t>(req, stats(), error(req->errorno));
+                else invoke_from_req<callback_t>(req, stats(*reinterpret_cast<const uv_statbuf_t*>(req->ptr)), error());
+                delete_req(req);
+            }
+
+            // names of a uv_fs_readdir() result: req->result NUL-terminated strings, back to back.
+            inline std::vector<std::string> dir_entries(uv_fs_t* req)
+            {
+                std::vector<std::string> entries;
+                entries.reserve(static_cast<std::size_t>(req->result));
+
+                auto name = static_cast<const char*>(req->ptr);
+                for(ssize_t i = 0; i < req->result; ++i)
+                {
+                    entries.push_back(name);
+                    name += entries.back().size() + 1;
+                }
+                return entries;
+            }
+
+            inline std::string join_path(const std::string& dir, const char* name, std::size_t len)
+            {
+                std::string path;
+                path.reserve(dir.size() + 1 + len);
+                path += dir;
+                if(path.empty() || path[path.size()-1] != '/') path += '/';
+                path.append(name, len);
+                return path;
+            }
+
+            inline bool stat(uv_loop_t* loop, const std::string& path, std::function<void(const stats& st, error e)> callback)
+            {
+                auto req = create_req(loop, std::move(callback));
+                if(uv_fs_stat(loop, req, path.c_str(), stat_cb<decltype(callback)>)) {
+                    delete_req(req);
+                    return false;
+                }
+                return true;
+            }
+
+            inline bool lstat(uv_loop_t* loop, const std::string& path, std::function<void(const stats& st, error e)> callback)
+            {
+                auto req = create_req(loop, std::move(callback));
+                if(uv_fs_lstat(loop, req, path.c_str(), stat_cb<decltype(callback)>)) {
+                    delete_req(req);
+                    return false;
+                }
+                return true;
+            }
+
+            inline bool fstat(uv_loop_t* loop, file_handle fd, std::function<void(const stats& st, error e)> callback)
+            {
+                auto req = create_req(loop, std::move(callback));
+                if(uv_fs_fstat(loop, req, fd, stat_cb<decltype(callback)>)) {
+                    delete_req(req);
+                    return false;
+                }
+                return true;
+            }
+
+            inline bool readdir(uv_loop_t* loop, const std::string& path, std::function<void(const std::vector<std::string>& entries, error e)> callback)
+            {
+                auto req = create_req(loop, std::move(callback));
+                if(uv_fs_readdir(loop, req, path.c_str(), 0, [](uv_fs_t* req){
+                    assert(req->fs_type == UV_FS_READDIR);
+
+                    if(req->errorno) invoke_from_req<decltype(callback)>(req, std::vector<std::string>(), error(req->errorno));
+                    else invoke_from_req<decltype(callback)>(req, dir_entries(req), error());
+                    delete_req(req);
+                })) {
+                    delete_req(req);
+                    return false;
+                }
+                return true;
+            }
+
+            /*!
+             *  State of a walk(): directories still to be read and paths still to be lstat()ed.
+             *  Paths are served before directories and both last-in first-out, so that the queues only
+             *  hold the entries of the directories being expanded, not the whole tree.
+             */
+            class walker
+            {
+            public:
+                typedef std::function<void(const std::string& path, const stats& st)> entry_callback;
+                typedef std::function<void(error e)> end_callback;
+
+                walker(uv_loop_t* loop, const std::string& root, entry_callback on_entry, end_callback on_end, std::size_t max_in_flight)
+                    : loop_(loop)
+                    , on_entry_(std::move(on_entry))
+                    , on_end_(std::move(on_end))
+                    , max_in_flight_(std::max<std::size_t>(max_in_flight, 1))
+                    , in_flight_(0)
+                    , dirs_(1, root)
+                    , paths_()
+                    , error_()
+                {}
+
+                // issues requests up to max_in_flight; deletes the walker once there is nothing left.
+                void pump()
+                {
+                    auto& ops = native::internal::loop_local<op_pool>(loop_);
+                    while(in_flight_ < max_in_flight_ && (!paths_.empty() || !dirs_.empty()))
+                    {
+                        auto o = ops.acquire();
+                        o->req.data = o;
+                        o->w = this;
+                        int r;
+                        if(!paths_.empty())
+                        {
+                            o->path = std::move(paths_.back());
+                            paths_.pop_back();
+                            r = uv_fs_lstat(loop_, &o->req, o->path.c_str(), on_lstat);
+                        }
+                        else
+                        {
+                            o->path = std::move(dirs_.back());
+                            dirs_.pop_back();
+                            r = uv_fs_readdir(loop_, &o->req, o->path.c_str(), 0, on_readdir);
+                        }
+
+                        if(r)
+                        {
+                            // failed to initiate the request: skip the path
+                            fail(uv_last_error(loop_));
+                            ops.release(o);
+                            continue;
+                        }
+                        ++in_flight_;
+                    }
+
+                    if(!in_flight_)
+                    {
+                        auto callback = std::move(on_end_);
+                        auto e = error_;
+                        delete this;
+                        if(callback) callback(e);
+                    }
+                }
+
+            private:
+                // one lstat() or readdir(); recycled through a per-loop pool.
+                struct op
+                {
+                    uv_fs_t req;
+                    walker* w;
+                    std::string path;
+                };
+
+                typedef native::internal::object_pool<op> op_pool;
+
+                static void on_lstat(uv_fs_t* req)
+                {
+                    assert(req->fs_type == UV_FS_LSTAT);
+
+                    auto o = reinterpret_cast<op*>(req->data);
+                    auto w = o->w;
+                    --w->in_flight_;
+                    if(req->errorno)
+                    {
+                        // e.g. removed since its directory was read
+                        w->fail(error(req->errorno));
+                    }
+                    else
+                    {
+                        stats st(*reinterpret_cast<const uv_statbuf_t*>(req->ptr));
+                        if(w->on_entry_) w->on_entry_(o->path, st);
+                        if(st.is_directory()) w->dirs_.push_back(std::move(o->path));
+                    }
+                    uv_fs_req_cleanup(req);
+                    native::internal::loop_local<op_pool>(w->loop_).release(o);
+                    w->pump();
+                }
+
+                static void on_readdir(uv_fs_t* req)
+                {
+                    assert(req->fs_type == UV_FS_READDIR);
+
+                    auto o = reinterpret_cast<op*>(req->data);
+                    auto w = o->w;
+                    --w->in_flight_;
+                    if(req->errorno)
+                    {
+                        w->fail(error(req->errorno));
+                    }
+                    else
+                    {
+                        // the names are joined straight from the result: one allocation per entry, for its path
+                        auto name = static_cast<const char*>(req->ptr);
+                        for(ssize_t i = 0; i < req->result; ++i)
+                        {
+                            auto len = std::strlen(name);
+                            w->paths_.push_back(join_path(o->path, name, len));
+                            name += len + 1;
+                        }
+                    }
+                    uv_fs_req_cleanup(req);
+                    native::internal::loop_local<op_pool>(w->loop_).release(o);
+                    w->pump();
+                }
+
+                void fail(error e)
+                {
+                    if(!error_) error_ = e;
+                }
+
+            private:
+                walker(const walker&);
+                void operator =(const walker&);
+
+            private:
+                uv_loop_t* loop_;
+                entry_callback on_entry_;
+                end_callback on_end_;
+                std::size_t max_in_flight_;
+                std::size_t in_flight_;
+                std::vector<std::string> dirs_;
+                std::vector<std::string> paths_;
+                error error_; // first error
+            };
+
+            inline bool walk(uv_loop_t* loop, const std::string& root, walker::entry_callback on_entry, walker::end_callback on_end, std::size_t max_in_flight)
+            {
+                (new walker(loop, root, std::move(on_entry), std::move(on_end), max_in_flight))->pump();
+                return true;
+            }
+        }
+
+        inline bool stat(const std::string& path, std::function<void(const stats& st, error e)> callback)
+        {
+            return internal::stat(uv_default_loop(), path, std::move(callback));
+        }
+
+        inline bool stat(native::loop& l, const std::string& path, std::function<void(const stats& st, error e)> callback)
+        {
+            return internal::stat(l.get(), path, std::move(callback));
+        }
+
+        /*!
+         *  Like stat(), but a symbolic link is not followed.
+         */
+        inline bool lstat(const std::string& path, std::function<void(const stats& st, error e)> callback)
+        {
+            return internal::lstat(uv_default_loop(), path, std::move(callback));
+        }
+
+        inline bool lstat(native::loop& l, const std::string& path, std::function<void(const stats& st, error e)> callback)
+        {
+            return internal::lstat(l.get(), path, std::move(callback));
+        }
+
+        inline bool fstat(file_handle fd, std::function<void(const stats& st, error e)> callback)
+        {
+            return internal::fstat(uv_default_loop(), fd, std::move(callback));
+        }
+
+        inline bool fstat(native::loop& l, file_handle fd, std::function<void(const stats& st, error e)> callback)
+        {
+            return internal::fstat(l.get(), fd, std::move(callback));
+        }
+
+        /*!
+         *  Lists the names of the entries of a directory ("." and ".." excluded).
+         */
+        inline bool readdir(const std::string& path, std::function<void(const std::vector<std::string>& entries, error e)> callback)
+        {
+            return internal::readdir(uv_default_loop(), path, std::move(callback));
+        }
+
+        inline bool readdir(native::loop& l, const std::string& path, std::function<void(const std::vector<std::string>& entries, error e)> callback)
+        {
+            return internal::readdir(l.get(), path, std::move(callback));
+        }
+
+        /*!
+         *  Recursively lists the tree below root: on_entry gets the path and lstat() result of every entry
+         *  as soon as it is known, then on_end is invoked once, with the first error met (the walk goes on
+         *  past unreadable entries). Symbolic links are reported, not followed.
+         *  Up to max_in_flight requests are queued to the threadpool at a time, which runs UV_THREADPOOL_SIZE of them in parallel.
+         */
+        inline bool walk(const std::string& root, std::function<void(const std::string& path, const stats& st)> on_entry, std::function<void(error e)> on_end, std::size_t max_in_flight=default_walk_concurrency)
+        {
+            return internal::walk(uv_default_loop(), root, std::move(on_entry), std::move(on_end), max_in_flight);
+        }
+
+        inline bool walk(native::loop& l, const std::string& root, std::function<void(const std::string& path, const stats& st)> on_entry, std::function<void(error e)> on_end, std::size_t max_in_flight=default_walk_concurrency)
+        {
+            return internal::walk(l.get(), root, std::move(on_entry), std::move(on_end), max_in_flight);
+        }
+
+        // read_stream/write_stream defaults
+        static const std::size_t default_stream_chunk_size = 64 * 1024;
+        static const std::size_t default_read_ahead = 4;
+        static const std::size_t default_high_water_mark = 1024 * 1024;
+
+        class read_stream;
+        class write_stream;
+        typedef std::shared_ptr<read_stream> read_stream_ptr;
+        typedef std::shared_ptr<write_stream> write_stream_ptr;
+
+        /*!
+         *  Reads a file from start to end, chunk_size bytes per read with up to read_ahead reads in flight.
+         *  Chunks are delivered in file order. While paused no reads are issued, so at most
+         *  read_ahead chunks are held by the stream whatever the size of the file.
+         *  Callbacks are not invoked after close().
+         */
+        class read_stream : public std::enable_shared_from_this<read_stream>
+        {
+        public:
+            typedef std::function<void(read_buffer buf)> data_callback;
+            typedef std::function<void(error e)> end_callback;
+
+            static read_stream_ptr create(const std::string& path, std::size_t chunk_size=default_stream_chunk_size, std::size_t read_ahead=default_read_ahead)
+            {
+                return read_stream_ptr(new read_stream(uv_default_loop(), path, -1, chunk_size, read_ahead));
+            }
+
+            static read_stream_ptr create(native::loop& l, const std::string& path, std::size_t chunk_size=default_stream_chunk_size, std::size_t read_ahead=default_read_ahead)
+            {
+                return read_stream_ptr(new read_stream(l.get(), path, -1, chunk_size, read_ahead));
+            }
+
+            /*!
+             *  Reads from the current position of fd, which is closed with the stream.
+             */
+            static read_stream_ptr create(file_handle fd, std::size_t chunk_size=default_stream_chunk_size, std::size_t read_ahead=default_read_ahead)
+            {
+                return read_stream_ptr(new read_stream(uv_default_loop(), std::string(), fd, chunk_size, read_ahead));
+            }
+
+            static read_stream_ptr create(native::loop& l, file_handle fd, std::size_t chunk_size=default_stream_chunk_size, std::size_t read_ahead=default_read_ahead)
+            {
+                return read_stream_ptr(new read_stream(l.get(), std::string(), fd, chunk_size, read_ahead));
+            }
+
+            ~read_stream()
+            {
+                // chunks read but never delivered (the stream was dropped while paused)
+                auto& pool = native::internal::loop_local<native::internal::buffer_pool>(loop_);
+                auto& chunks = native::internal::loop_local<chunk_pool>(loop_);
+                while(head_)
+                {
+                    auto c = head_;
+                    head_ = c->next;
+                    pool.release(c->base, c->capacity);
+                    chunks.release(c);
+                }
+                close_file();
+            }
+
+        public:
+            /*!
+             *  Starts reading: on_data gets every chunk, then on_end is invoked once, with an error if reading failed.
+             */
+            bool start(data_callback on_data, end_callback on_end)
+            {
+                if(started_) return false;
+                started_ = true;
+                on_data_ = std::move(on_data);
+                on_end_ = std::move(on_end);
+
+                if(fd_ >= 0) return stat();
+
+                auto self = shared_from_this();
+                return internal::open(loop_, path_, read_only, 0, [self](file_handle fd, error e) {
+                    if(e)
+                    {
+                        self->fail(e);
+                    }
+                    else
+                    {
+                        self->fd_ = fd;
+                        if(!self->stat()) self->fail(uv_last_error(self->loop_));
+                    }
+                });
+            }
+
+            void pause()
+            {
+                paused_ = true;
+            }
+
+            void resume()
+            {
+                if(!paused_) return;
+                paused_ = false;
+                if(!delivering_ && fd_ >= 0) deliver();
+            }
+
+            bool paused() const { return paused_; }
+
+            /*!
+             *  Stops reading and closes the file. No callback is invoked after this.
+             */
+            void close()
+            {
+                ended_ = true;
+                on_data_ = nullptr;
+                on_end_ = nullptr;
+
+                // chunks read but not delivered (e.g. while paused) go back to the pools now:
+                // only reads still in flight keep the file open until they complete.
+                auto& pool = native::internal::loop_local<native::internal::buffer_pool>(loop_);
+                auto& chunks = native::internal::loop_local<chunk_pool>(loop_);
+                chunk* prev = nullptr;
+                for(auto c = head_; c;)
+                {
+                    auto next = c->next;
+                    if(c->done)
+                    {
+                        if(prev) prev->next = next;
+                        else head_ = next;
+                        if(tail_ == c) tail_ = prev;
+                        --queued_;
+                        pool.release(c->base, c->capacity);
+                        chunks.release(c);
+                    }
+                    else
+                    {
+                        prev = c;
+                    }
+                    c = next;
+                }
+                if(!head_) finish();
+            }
+
+            /*!
+             *  Writes the whole file to dest, pausing while more than high_water_mark bytes are queued on it.
+             *  callback is invoked once everything has been written, or on the first error.
+             *  dest must outlive the transfer.
+             */
+            bool pipe(native::base::stream& dest, std::function<void(error e)> callback, std::size_t high_water_mark=default_high_water_mark)
+            {
+                struct pipe_state
+                {
+                    std::size_t queued;
+                    bool ended;
+                    bool done;
+                    error end_error;
+                    std::function<void(error e)> callback;
+
+                    void complete(error e)
+                    {
+                        if(done) return;
+                        done = true;
+                        auto cb = std::move(callback);
+                        cb(e);
+                    }
+                };
+
+                auto state = std::make_shared<pipe_state>();
+                state->queued = 0;
+                state->ended = false;
+                state->done = false;
+                state->callback = std::move(callback);
+
+                auto self = shared_from_this();
+                auto target = &dest;
+                return start([=](read_buffer buf) {
+                    // the chunk is written without a copy and released once written.
+                    auto owner = std::make_shared<read_buffer>(std::move(buf));
+                    auto size = owner->size();
+                    state->queued += size;
+                    if(!target->write(owner->data(), size, owner, [=](error e) {
+                        state->queued -= size;
+                        if(e)
+                        {
+                            self->close();
+                            state->complete(e);
+                        }
+                        else if(state->ended)
+                        {
+                            if(!state->queued) state->complete(state->end_error);
+                        }
+                        else if(state->queued <= high_water_mark / 2)
+                        {
+                            self->resume();
+                        }
+                    }))
+                    {
+                        self->close();
+                        state->complete(uv_last_error(self->loop_));
+                        return;
+                    }
+                    if(state->queued >= high_water_mark) self->pause();
+                }, [=](error e) {
+                    state->ended = true;
+                    state->end_error = e;
+                    if(!state->queued || e) state->complete(e);
+                });
+            }
+
+            /*!
+             *  Copies the whole file to dest, pausing while dest is above its high water mark.
+             *  dest is ended (closed) afterwards, and callback invoked with the first error of either side.
+             */
+            bool pipe(write_stream_ptr dest, std::function<void(error e)> callback);
+
+        private:
+            // one uv_fs_read() of chunk_size bytes; kept in file order from head_ to tail_.
+            // chunks are recycled through a per-loop pool.
+            struct chunk
+            {
+                uv_fs_t req;
+                read_stream_ptr self; // keeps the stream alive while the read is in flight
+                chunk* next;
+                char* base;
+                std::size_t capacity;
+                std::size_t length; // requested
+                std::size_t size;
+                bool done;
+                uv_err_code errorno;
+            };
+
+            typedef native::internal::object_pool<chunk> chunk_pool;
+
+            read_stream(uv_loop_t* loop, const std::string& path, file_handle fd, std::size_t chunk_size, std::size_t read_ahead)
+                : loop_(loop)
+                , path_(path)
+                , fd_(fd)
+                , chunk_size_(std::max<std::size_t>(chunk_size, 1))
+                , read_ahead_(std::max<std::size_t>(read_ahead, 1))
+                , seekable_(false)
+                , size_(0)
+                , offset_(0)
+                , head_(nullptr)
+                , tail_(nullptr)
+                , queued_(0)
+                , on_data_()
+                , on_end_()
+                , end_error_()
+                , started_(false)
+                , paused_(false)
+                , delivering_(false)
+                , eof_(false)
+                , ended_(false)
+                , finished_(false)
+            {
+            }
+
+            read_stream(const read_stream&);
+            void operator =(const read_stream&);
+
+            // regular files are read with positional reads, read_ahead at a time, up to their size at start.
+            // anything else (pipes, character devices, procfs, ...) is read sequentially, one read at a time.
+            bool stat()
+            {
+                auto self = shared_from_this();
+                return internal::fstat(loop_, fd_, [self](const stats& st, error e) {
+                    if(!e && st.is_file() && st.size > 0)
+                    {
+                        self->seekable_ = true;
+                        self->size_ = st.size;
+                        self->offset_ = ::lseek(self->fd_, 0, SEEK_CUR);
+                        if(self->offset_ < 0) self->offset_ = 0;
+                    }
+                    self->deliver();
+                });
+            }
+
+            void read_more()
+            {
+                auto& pool = native::internal::loop_local<native::internal::buffer_pool>(loop_);
+                auto& chunks = native::internal::loop_local<chunk_pool>(loop_);
+                while(!paused_ && !eof_ && !ended_ && queued_ < (seekable_ ? read_ahead_ : 1))
+                {
+                    auto len = chunk_size_;
+                    if(seekable_)
+                    {
+                        if(offset_ >= size_)
+                        {
+                            eof_ = true;
+                            break;
+                        }
+                        if(static_cast<off_t>(len) > size_ - offset_) len = static_cast<std::size_t>(size_ - offset_);
+                    }
+
+                    auto c = chunks.acquire();
+                    c->req.data = c;
+                    c->next = nullptr;
+                    c->capacity = std::max(len, pool.buffer_size()); // chunks up to the pooled size share pooled buffers
+                    c->base = pool.acquire(c->capacity);
+                    c->length = len;
+                    c->size = 0;
+                    c->done = false;
+                    c->errorno = UV_OK;
+                    if(uv_fs_read(loop_, &c->req, fd_, c->base, len, seekable_ ? offset_ : -1, on_read))
+                    {
+                        // failed to initiate uv_fs_read()
+                        pool.release(c->base, c->capacity);
+                        chunks.release(c);
+                        ended_ = true;
+                        end_error_ = uv_last_error(loop_);
+                        break;
+                    }
+                    c->self = shared_from_this();
+                    if(seekable_) offset_ += len;
+                    if(tail_) tail_->next = c;
+                    else head_ = c;
+                    tail_ = c;
+                    ++queued_;
+                }
+            }
+
+            static void on_read(uv_fs_t* req)
+            {
+                assert(req->fs_type == UV_FS_READ);
+
+                auto c = reinterpret_cast<chunk*>(req->data);
+                auto self = std::move(c->self);
+                c->done = true;
+                if(req->errorno) c->errorno = static_cast<uv_err_code>(req->errorno);
+                else c->size = static_cast<std::size_t>(req->result);
+                uv_fs_req_cleanup(req);
+
+                self->deliver();
+            }
+
+            // hands completed chunks over in file order, then keeps read_ahead reads in flight.
+            void deliver()
+            {
+                auto self = shared_from_this();
+                auto& pool = native::internal::loop_local<native::internal::buffer_pool>(loop_);
+                auto& chunks = native::internal::loop_local<chunk_pool>(loop_);
+
+                delivering_ = true;
+                while(head_ && head_->done && (ended_ || !paused_))
+                {
+                    auto c = head_;
+                    head_ = c->next;
+                    if(!head_) tail_ = nullptr;
+                    --queued_;
+
+                    read_buffer buf(&pool, c->base, c->capacity, c->size);
+                    auto errorno = c->errorno;
+                    auto shrunk = seekable_ && c->size < c->length;
+                    chunks.release(c);
+
+                    if(!ended_)
+                    {
+                        if(errorno)
+                        {
+                            ended_ = true;
+                            end_error_ = error(errorno);
+                        }
+                        else if(buf.empty() || shrunk)
+                        {
+                            // EOF (or a file that shrank): nothing after this chunk is delivered.
+                            ended_ = true;
+                        }
+
+                        if(!buf.empty() && on_data_)
+                        {
+                            auto callback = on_data_;
+                            callback(std::move(buf));
+                        }
+                    }
+                }
+                delivering_ = false;
+
+                read_more();
+                if(!head_ && (eof_ || ended_)) finish();
+            }
+
+            void finish()
+            {
+                if(finished_ || head_) return;
+                finished_ = true;
+
+                close_file();
+
+                // drop the callbacks: they may hold the stream (see pipe()).
+                auto callback = std::move(on_end_);
+                on_data_ = nullptr;
+                on_end_ = nullptr;
+                if(callback) callback(end_error_);
+            }
+
+            void fail(error e)
+            {
+                ended_ = true;
+                end_error_ = e;
+                finish();
+            }
+
+            void close_file()
+            {
+                if(fd_ < 0) return;
+                internal::close(loop_, fd_, [](error) {});
+                fd_ = -1;
+            }
+
+        private:
+            uv_loop_t* loop_;
+            std::string path_;
+            file_handle fd_;
+            std::size_t chunk_size_;
+            std::size_t read_ahead_;
+            bool seekable_;
+            off_t size_;
+            off_t offset_; // of the next read
+            chunk* head_; // oldest read in flight or waiting for delivery
+            chunk* tail_;
+            std::size_t queued_; // chunks from head_ to tail_
+            data_callback on_data_;
+            end_callback on_end_;
+            error end_error_;
+            bool started_;
+            bool paused_;
+            bool delivering_;
+            bool eof_; // no more reads to issue
+            bool ended_; // no more chunks to deliver
+            bool finished_;
+        };
+
+        /*!
+         *  Writes a file sequentially from a queue of buffers, one uv_fs_write() at a time.
+         *  write() returns false once high_water_mark bytes are queued: wait for the drain callback before writing more.
+         *  The file is opened on creation; writes made before it is open are queued.
+         */
+        class write_stream : public std::enable_shared_from_this<write_stream>
+        {
+            friend class native::file;
+
+        public:
+            static write_stream_ptr create(const std::string& path, int flags=fs::write_only|fs::create|fs::truncate, int mode=0664, std::size_t high_water_mark=default_high_water_mark)
+            {
+                return create(uv_default_loop(), path, flags, mode, high_water_mark);
+            }
+
+            static write_stream_ptr create(native::loop& l, const std::string& path, int flags=fs::write_only|fs::create|fs::truncate, int mode=0664, std::size_t high_water_mark=default_high_water_mark)
+            {
+                return create(l.get(), path, flags, mode, high_water_mark);
+            }
+
+            /*!
+             *  Writes at the current position of fd, which is closed by end().
+             */
+            static write_stream_ptr create(file_handle fd, std::size_t high_water_mark=default_high_water_mark)
+            {
+                return write_stream_ptr(new write_stream(uv_default_loop(), fd, high_water_mark));
+            }
+
+            static write_stream_ptr create(native::loop& l, file_handle fd, std::size_t high_water_mark=default_high_water_mark)
+            {
+                return write_stream_ptr(new write_stream(l.get(), fd, high_water_mark));
+            }
+
+            ~write_stream()
+            {
+                if(fd_ >= 0) internal::close(loop_, fd_, [](error) {});
+            }
+
+        public:
+            /*!
+             *  Queues a copy of buf (or buf itself when moved in).
+             */
+            bool write(std::string buf)
+            {
+                chunk c;
+                c.str = std::move(buf);
+                c.data = c.str.data();
+                c.size = c.str.size();
+                return push(std::move(c));
+            }
+
+            /*!
+             *  Queues a chunk from read_stream: written without a copy.
+             */
+            bool write(read_buffer buf)
+            {
+                chunk c;
+                c.data = buf.data();
+                c.size = buf.size();
+                c.buf = std::move(buf);
+                return push(std::move(c));
+            }
+
+            /*!
+             *  Queues len bytes from buf without a copy; owner keeps buf alive until written.
+             */
+            bool write(const char* buf, std::size_t len, std::shared_ptr<const void> owner)
+            {
+                chunk c;
+                c.owner = std::move(owner);
+                c.data = buf;
+                c.size = len;
+                return push(std::move(c));
+            }
+
+            /*!
+             *  Sets the callback invoked when the queue falls below the high water mark after write() returned false.
+             */
+            void on_drain(std::function<void()> callback)
+            {
+                on_drain_ = std::move(callback);
+            }
+
+            /*!
+             *  Sets the callback invoked on the first write error: queued and later writes are dropped.
+             */
+            void on_error(std::function<void(error e)> callback)
+            {
+                on_error_ = std::move(callback);
+            }
+
+            /*!
+             *  Closes the file once everything queued has been written.
+             *  callback gets the first error of the stream, if any.
+             */
+            void end(std::function<void(error e)> callback)
+            {
+                if(ending_) return;
+                ending_ = true;
+                on_end_ = std::move(callback);
+                if(failed_) close();
+                else if(fd_ >= 0 && !writing_) write_next();
+            }
+
+            std::size_t queued() const { return queued_; }
+            std::size_t bytes_written() const { return written_; }
+
+        private:
+            struct chunk
+            {
+                std::string str;
+                read_buffer buf;
+                std::shared_ptr<const void> owner;
+                const char* data;
+                std::size_t size;
+
+                chunk() : str(), buf(), owner(), data(nullptr), size(0) {}
+                chunk(chunk&& x)
+                    : str(std::move(x.str))
+                    , buf(std::move(x.buf))
+                    , owner(std::move(x.owner))
+                    , data(x.data)
+                    , size(x.size)
+                {
+                    // a moved short string changes address
+                    if(!str.empty()) data = str.data();
+                }
+            };
+
+            write_stream(uv_loop_t* loop, file_handle fd, std::size_t high_water_mark)
+                : loop_(loop)
+                , req_()
+                , fd_(fd)
+                , high_water_mark_(high_water_mark)
+                , queue_()
+                , queued_(0)
+                , front_written_(0)
+                , written_(0)
+                , self_()
+                , on_drain_()
+                , on_error_()
+                , on_end_()
+                , error_()
+                , writing_(false)
+                , need_drain_(false)
+                , ending_(false)
+                , failed_(false)
+            {
+                req_.data = this;
+            }
+
+            write_stream(const write_stream&);
+            void operator =(const write_stream&);
+
+            static write_stream_ptr create(uv_loop_t* loop, const std::string& path, int flags, int mode, std::size_t high_water_mark)
+            {
+                auto ws = write_stream_ptr(new write_stream(loop, -1, high_water_mark));
+                if(!internal::open(loop, path, flags, mode, [ws](file_handle fd, error e) {
+                    if(e)
+                    {
+                        ws->fail(e);
+                    }
+                    else
+                    {
+                        ws->fd_ = fd;
+                        ws->write_next();
+                    }
+                }))
+                {
+                    ws->fail(uv_last_error(loop));
+                }
+                return ws;
+            }
+
+            bool push(chunk&& c)
+            {
+                if(failed_ || ending_) return false;
+                if(c.size)
+                {
+                    queued_ += c.size;
+                    queue_.push_back(std::move(c));
+                    if(fd_ >= 0 && !writing_) write_next();
+                }
+                if(queued_ < high_water_mark_) return true;
+
+                need_drain_ = true;
+                return false;
+            }
+
+            void write_next()
+            {
+                if(failed_) return;
+                if(queue_.empty())
+                {
+                    if(ending_) close();
+                    return;
+                }
+
+                auto& c = queue_.front();
+                writing_ = true;
+                if(uv_fs_write(loop_, &req_, fd_, const_cast<char*>(c.data + front_written_), c.size - front_written_, -1, on_write))
+                {
+                    // failed to initiate uv_fs_write()
+                    writing_ = false;
+                    fail(uv_last_error(loop_));
+                    return;
+                }
+                self_ = shared_from_this();
+            }
+
+            static void on_write(uv_fs_t* req)
+            {
+                assert(req->fs_type == UV_FS_WRITE);
+
+                auto ws = reinterpret_cast<write_stream*>(req->data);
+                auto self = std::move(ws->self_);
+                ws->writing_ = false;
+                if(req->errorno)
+                {
+                    auto e = error(req->errorno);
+                    uv_fs_req_cleanup(req);
+                    ws->fail(e);
+                    return;
+                }
+
+                // partial writes continue from where they stopped
+                auto n = static_cast<std::size_t>(req->result);
+                uv_fs_req_cleanup(req);
+                ws->written_ += n;
+                ws->queued_ -= n;
+                ws->front_written_ += n;
+                if(ws->front_written_ == ws->queue_.front().size)
+                {
+                    ws->queue_.pop_front();
+                    ws->front_written_ = 0;
+                }
+
+                if(ws->need_drain_ && ws->queued_ < ws->high_water_mark_)
+                {
+                    ws->need_drain_ = false;
+                    if(ws->on_drain_) ws->on_drain_();
+                }
+                if(!ws->writing_) ws->write_next();
+            }
+
+            void fail(error e)
+            {
+                if(failed_) return;
+                failed_ = true;
+                error_ = e;
+                queue_.clear();
+                queued_ = 0;
+
+                auto callback = std::move(on_error_);
+                on_error_ = nullptr;
+                if(callback) callback(e);
+                if(ending_) close();
+            }
+
+            void close()
+            {
+                auto callback = std::move(on_end_);
+                on_end_ = nullptr;
+                on_drain_ = nullptr;
+                on_error_ = nullptr;
+
+                auto e = error_;
+                auto fd = fd_;
+                fd_ = -1;
+                if(fd < 0)
+                {
+                    if(callback) callback(e);
+                }
+                else if(!internal::close(loop_, fd, [callback, e](error close_error) mutable {
+                    if(callback) callback(e ? e : close_error);
+                }))
+                {
+                    if(callback) callback(e ? e : error(uv_last_error(loop_)));
+                }
+            }
+
+        private:
+            uv_loop_t* loop_;
+            uv_fs_t req_;
+            file_handle fd_;
+            std::size_t high_water_mark_;
+            std::deque<chunk> queue_;
+            std::size_t queued_; // bytes not written yet
+            std::size_t front_written_; // bytes of the front chunk already written
+            std::size_t written_;
+            write_stream_ptr self_; // keeps the stream alive while a write is in flight
+            std::function<void()> on_drain_;
+            std::function<void(error e)> on_error_;
+            std::function<void(error e)> on_end_;
+            error error_;
+            bool writing_;
+            bool need_drain_;
+            bool ending_;
+            bool failed_;
+        };
+
+        inline bool read_stream::pipe(write_stream_ptr dest, std::function<void(error e)> callback)
+        {
+            auto self = shared_from_this();
+            dest->on_drain([self]() { self->resume(); });
+            dest->on_error([self, dest, callback](error) {
+                self->close();
+                dest->end(callback);
+            });
+            return start([self, dest](read_buffer buf) {
+                if(!dest->write(std::move(buf))) self->pause();
+            }, [dest, callback](error e) {
+                dest->end([callback, e](error write_error) mutable {
+                    callback(e ? e : write_error);
+                });
+            });
+        }
+
+        // append_writer defaults: a batch is written once it holds batch_size bytes or after flush_delay ms.
+        static const std::size_t default_append_batch_size = 64 * 1024;
+        static const uint64_t default_append_flush_delay = 10;
+
+        class append_writer;
+        typedef std::shared_ptr<append_writer> append_writer_ptr;
+
+        /*!
+         *  Appends records (e.g. log lines) to a file in groups: appends are copied into the current batch,
+         *  which is written with a single uv_fs_write() once it holds batch_size bytes or flush_delay ms after
+         *  its first append. Appends made while a batch is being written form the next group (double buffering).
+         *  With sync set, each group is followed by fdatasync(); append callbacks fire once their group is durable.
+         *  Keep the writer until close() has completed: appends still in the batch are lost otherwise.
+         */
+        class append_writer : public std::enable_shared_from_this<append_writer>
+        {
+        public:
+            static append_writer_ptr create(const std::string& path, bool sync=false, std::size_t batch_size=default_append_batch_size, uint64_t flush_delay=default_append_flush_delay)
+            {
+                return create(uv_default_loop(), path, sync, batch_size, flush_delay);
+            }
+
+            static append_writer_ptr create(native::loop& l, const std::string& path, bool sync=false, std::size_t batch_size=default_append_batch_size, uint64_t flush_delay=default_append_flush_delay)
+            {
+                return create(l.get(), path, sync, batch_size, flush_delay);
+            }
+
+            ~append_writer()
+            {
+                close_timer();
+                if(fd_ >= 0) internal::close(loop_, fd_, [](error) {});
+            }
+
+        public:
+            /*!
+             *  Appends a copy of data. callback, if set, is invoked once the group holding it is written
+             *  (and synced). Returns false if the writer is closed or its file could not be opened.
+             */
+            bool append(const char* data, std::size_t len, std::function<void(error e)> callback=nullptr)
+            {
+                if(closing_ || failed_) return false;
+
+                active_.data.append(data, len);
+                if(callback) active_.callbacks.push_back(std::move(callback));
+                if(active_.data.size() >= batch_size_) flush_now();
+                else if(!flushing_) start_timer();
+                return true;
+            }
+
+            bool append(const std::string& data, std::function<void(error e)> callback=nullptr)
+            {
+                return append(data.data(), data.size(), std::move(callback));
+            }
+
+            /*!
+             *  Writes the current batch now; callback is invoked once it is written (and synced).
+             */
+            void flush(std::function<void(error e)> callback=nullptr)
+            {
+                if(callback) active_.callbacks.push_back(std::move(callback));
+                flush_now();
+            }
+
+            /*!
+             *  Writes what is left, then closes the file. No append is accepted afterwards.
+             */
+            void close(std::function<void(error e)> callback=nullptr)
+            {
+                if(closing_) return;
+                closing_ = true;
+                close_callback_ = std::move(callback);
+                flush_now();
+            }
+
+            std::size_t bytes_written() const { return written_; }
+            std::size_t groups_written() const { return groups_; }
+
+        private:
+            // records of one group and the callbacks waiting for them
+            struct batch
+            {
+                std::string data;
+                std::vector<std::function<void(error e)>> callbacks;
+            };
+
+            append_writer(uv_loop_t* loop, bool sync, std::size_t batch_size, uint64_t flush_delay)
+                : loop_(loop)
+                , req_()
+                , timer_(nullptr)
+                , fd_(-1)
+                , sync_(sync)
+                , batch_size_(std::max<std::size_t>(batch_size, 1))
+                , flush_delay_(flush_delay)
+                , active_()
+                , flushing_batch_()
+                , offset_(0)
+                , written_(0)
+                , groups_(0)
+                , spare_callbacks_()
+                , self_()
+                , close_callback_()
+                , open_error_()
+                , flushing_(false)
+                , flush_requested_(false)
+                , closing_(false)
+                , failed_(false)
+            {
+                req_.data = this;
+            }
+
+            append_writer(const append_writer&);
+            void operator =(const append_writer&);
+
+            static append_writer_ptr create(uv_loop_t* loop, const std::string& path, bool sync, std::size_t batch_size, uint64_t flush_delay)
+            {
+                auto w = append_writer_ptr(new append_writer(loop, sync, batch_size, flush_delay));
+                if(!internal::open(loop, path, fs::write_only|fs::create|fs::append, 0644, [w](file_handle fd, error e) {
+                    if(e) w->fail(e);
+                    else w->fd_ = fd;
+                    if(w->flush_requested_) w->flush_now();
+                }))
+                {
+                    w->fail(uv_last_error(loop));
+                }
+                return w;
+            }
+
+            void start_timer()
+            {
+                if(!flush_delay_ || active_.data.empty()) return;
+                if(!timer_)
+                {
+                    timer_ = new uv_timer_t;
+                    uv_timer_init(loop_, timer_);
+                    timer_->data = this;
+                }
+                if(uv_is_active(reinterpret_cast<uv_handle_t*>(timer_))) return;
+                uv_timer_start(timer_, [](uv_timer_t* t, int) {
+                    reinterpret_cast<append_writer*>(t->data)->flush_now();
+                }, flush_delay_, 0);
+            }
+
+            void close_timer()
+            {
+                if(!timer_) return;
+                uv_close(reinterpret_cast<uv_handle_t*>(timer_), [](uv_handle_t* h) {
+                    delete reinterpret_cast<uv_timer_t*>(h);
+                });
+                timer_ = nullptr;
+            }
+
+            // Starts writing the active batch, or makes the write in progress start it when done.
+            void flush_now()
+            {
+                flush_requested_ = true;
+                if(flushing_ || (fd_ < 0 && !failed_)) return;
+
+                flush_requested_ = false;
+                if(timer_) uv_timer_stop(timer_);
+
+                if(active_.data.empty() && active_.callbacks.empty())
+                {
+                    if(closing_) finish();
+                    return;
+                }
+
+                std::swap(active_, flushing_batch_);
+                if(failed_)
+                {
+                    complete(open_error_);
+                    return;
+                }
+
+                flushing_ = true;
+                offset_ = 0;
+                self_ = shared_from_this();
+                write_next();
+            }
+
+            void write_next()
+            {
+                if(offset_ == flushing_batch_.data.size())
+                {
+                    if(!sync_ || flushing_batch_.data.empty())
+                    {
+                        complete(error());
+                    }
+                    else if(uv_fs_fdatasync(loop_, &req_, fd_, on_sync))
+                    {
+                        complete(uv_last_error(loop_));
+                    }
+                    return;
+                }
+
+                if(uv_fs_write(loop_, &req_, fd_, &flushing_batch_.data[offset_], flushing_batch_.data.size() - offset_, -1, on_write))
+                {
+                    complete(uv_last_error(loop_));
+                }
+            }
+
+            static void on_write(uv_fs_t* req)
+            {
+                assert(req->fs_type == UV_FS_WRITE);
+
+                auto w = reinterpret_cast<append_writer*>(req->data);
+                if(req->errorno)
+                {
+                    auto e = error(req->errorno);
+                    uv_fs_req_cleanup(req);
+                    w->complete(e);
+                    return;
+                }
+
+                // partial writes continue from where they stopped
+                w->offset_ += static_cast<std::size_t>(req->result);
+                w->written_ += static_cast<std::size_t>(req->result);
+                uv_fs_req_cleanup(req);
+                w->write_next();
+            }
+
+            static void on_sync(uv_fs_t* req)
+            {
+                assert(req->fs_type == UV_FS_FDATASYNC);
+
+                auto w = reinterpret_cast<append_writer*>(req->data);
+                auto e = req->errorno ? error(req->errorno) : error();
+                uv_fs_req_cleanup(req);
+                w->complete(e);
+            }
+
+            // The group is done: its callbacks fire, then whatever was appended meanwhile goes out.
+            void complete(error e)
+            {
+                auto self = std::move(self_);
+                flushing_ = false;
+                if(!flushing_batch_.data.empty()) ++groups_;
+
+                // the callbacks are swapped out (a callback may start the next group) with spare_callbacks_,
+                // so that both vectors keep their capacity for the next groups.
+                std::vector<std::function<void(error e)>> callbacks;
+                callbacks.swap(spare_callbacks_);
+                callbacks.swap(flushing_batch_.callbacks);
+                flushing_batch_.data.clear(); // the capacity is kept for the next group
+                for(auto& callback : callbacks) callback(e);
+                callbacks.clear();
+                if(callbacks.capacity() > spare_callbacks_.capacity()) spare_callbacks_.swap(callbacks);
+
+                if(flush_requested_ || closing_ || active_.data.size() >= batch_size_ || (failed_ && !active_.callbacks.empty())) flush_now();
+                else start_timer();
+            }
+
+            void fail(error e)
+            {
+                failed_ = true;
+                open_error_ = e;
+            }
+
+            void finish()
+            {
+                close_timer();
+                auto callback = std::move(close_callback_);
+                close_callback_ = nullptr;
+
+                auto fd = fd_;
+                fd_ = -1;
+                if(fd < 0)
+                {
+                    if(callback) callback(open_error_);
+                }
+                else if(!internal::close(loop_, fd, [callback](error e) {
+                    if(callback) callback(e);
+                }))
+                {
+                    if(callback) callback(uv_last_error(loop_));
+                }
+            }
+
+        private:
+            uv_loop_t* loop_;
+            uv_fs_t req_;
+            uv_timer_t* timer_;
+            file_handle fd_;
+            bool sync_;
+            std::size_t batch_size_;
+            uint64_t flush_delay_;
+            batch active_; // being filled
+            batch flushing_batch_; // being written
+            std::size_t offset_; // written part of flushing_batch_
+            std::size_t written_;
+            std::size_t groups_;
+            std::vector<std::function<void(error e)>> spare_callbacks_;
+            append_writer_ptr self_; // keeps the writer alive while a request is in flight
+            std::function<void(error e)> close_callback_;
+            error open_error_;
+            bool flushing_;
+            bool flush_requested_;
+            bool closing_;
+            bool failed_;
+        };
+    }
+
+    class file
+    {
+    public:
+        static bool read(const std::string& path, std::function<void(const std::string& str, error e)> callback)
+        {
+            return read(uv_default_loop(), path, std::move(callback));
+        }
+
+        static bool read(native::loop& l, const std::string& path, std::function<void(const std::string& str, error e)> callback)
+        {
+            return read(l.get(), path, std::move(callback));
+        }
+
+        static bool write(const std::string& path, const std::string& str, std::function<void(int nwritten, error e)> callback)
+        {
+            return write(uv_default_loop(), path, str, std::move(callback));
+        }
+
+        static bool write(native::loop& l, const std::string& path, const std::string& str, std::function<void(int nwritten, error e)> callback)
+        {
+            return write(l.get(), path, str, std::move(callback));
+        }
+
+    private:
+        static bool read(uv_loop_t* loop, const std::string& path, std::function<void(const std::string& str, error e)> callback)
+        {
+            return fs::internal::open(loop, path.c_str(), fs::read_only, 0, [=](fs::file_handle fd, error e) {
+                if(e)
+                {
+                    callback(std::string(), e);
+                }
+                else
+                {
+                    if(!fs::internal::read_to_end(loop, fd, [=](const std::string& str, error e) {
+                        fs::internal::close(loop, fd, [](error) {});
+                        callback(str, e);
+                    }, fs::default_read_chunk_size))
+                    {
+                        // failed to initiate read_to_end()
+                        fs::internal::close(loop, fd, [](error) {});
+                        callback(std::string(), error(uv_last_error(loop)));
+                    }
+                }
+            });
+        }
+
+        static bool write(uv_loop_t* loop, const std::string& path, const std::string& str, std::function<void(int nwritten, error e)> callback)
+        {
+            // replaces the file: written in full (partial writes are resumed), then closed.
+            auto ws = fs::write_stream::create(loop, path, fs::write_only|fs::create|fs::truncate, 0664, fs::default_high_water_mark);
+            ws->write(str);
+            ws->end([ws, callback](error e) {
+                callback(e ? 0 : static_cast<int>(ws->bytes_written()), e);
+            });
+            return true;
         }
     };
 }
@@ -6,6 +6,43 @@
 
 namespace native
 {
+    namespace internal
+    {
+        // uv handle allocated together with its callback slots.
+        template<typename T>
+        struct handle_storage
+        {
+            T handle;
+            callbacks table;
+            std::shared_ptr<void> state; // wrapper state released with the handle, e.g. udp's batch rings
+        };
+
+        /*!
+         *  Allocates a uv handle of type T whose data field points to its callback slots.
+         *  Handles passed to native::base::handle must come from here; they are freed by _delete_handle() on close.
+         */
+        template<typename T>
+        T* alloc_handle()
+        {
+            auto x = new handle_storage<T>;
+            x->handle.data = &x->table;
+            return &x->handle;
+        }
+
+        // state of a handle that came from alloc_handle<T>()
+        template<typename T>
+        std::shared_ptr<void>& handle_state(T* h)
+        {
+            return reinterpret_cast<handle_storage<T>*>(h)->state;
+        }
+
+        template<typename T>
+        void free_handle(uv_handle_t* h)
+        {
+            delete reinterpret_cast<handle_storage<T>*>(h);
+        }
+    }
+
     namespace base
     {
         class handle;
@@ -21,8 +58,6 @@ namespace native
             {
                 //printf("handle(): %x\n", this);
                 assert(uv_handle_);
-
-                uv_handle_->data = new callbacks(native::internal::uv_cid_max);
                 assert(uv_handle_->data);
             }
 
@@ -49,7 +84,7 @@ namespace native
 
             void close(std::function<void()> callback)
             {
-                callbacks::store(get()->data, native::internal::uv_cid_close, callback);
+                callbacks::store(get()->data, native::internal::uv_cid_close, std::move(callback));
                 uv_close(get(),
                     [](uv_handle_t* h) {
                         callbacks::invoke<decltype(callback)>(h->data, native::internal::uv_cid_close);
@@ -71,16 +106,12 @@ namespace native
         {
             assert(h);
 
-            // clean up SCM
-            if(h->data)
-            {
-                delete reinterpret_cast<callbacks*>(h->data);
-                h->data = nullptr;
-            }
-
             switch(h->type)
             {
-                case UV_TCP: delete reinterpret_cast<uv_tcp_t*>(h); break;
+                case UV_TCP: native::internal::free_handle<uv_tcp_t>(h); break;
+                case UV_NAMED_PIPE: native::internal::free_handle<uv_pipe_t>(h); break;
+                case UV_TIMER: native::internal::free_handle<uv_timer_t>(h); break;
+                case UV_UDP: native::internal::free_handle<uv_udp_t>(h); break;
                 default: assert(0); break;
             }
         }
@@ -1,13 +1,26 @@
 #ifndef __HTTP_H__
 #define __HTTP_H__
 
-#include <sstream>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <climits>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <ctime>
+#include <csignal>
+#include <sys/socket.h>
 #include <http_parser.h>
 #include "base.h"
 #include "handle.h"
+#include "loop.h"
 #include "net.h"
 #include "text.h"
 #include "callback.h"
+#include "fs.h"
+#include "timer.h"
 
 namespace native
 {
@@ -123,12 +136,107 @@ namespace native
             std::string buf_;
         };
 
+        /*!
+         *  Returns the Content-Type for the extension of path, "application/octet-stream" if unknown.
+         */
+        inline const char* get_mime_type(const std::string& path)
+        {
+            static const char* types[][2] = {
+                { "html", "text/html" }, { "htm", "text/html" }, { "css", "text/css" },
+                { "js", "application/javascript" }, { "json", "application/json" }, { "xml", "application/xml" },
+                { "txt", "text/plain" }, { "csv", "text/csv" }, { "md", "text/markdown" },
+                { "png", "image/png" }, { "jpg", "image/jpeg" }, { "jpeg", "image/jpeg" }, { "gif", "image/gif" },
+                { "svg", "image/svg+xml" }, { "ico", "image/x-icon" }, { "webp", "image/webp" },
+                { "woff", "font/woff" }, { "woff2", "font/woff2" }, { "ttf", "font/ttf" },
+                { "mp3", "audio/mpeg" }, { "mp4", "video/mp4" }, { "webm", "video/webm" },
+                { "pdf", "application/pdf" }, { "zip", "application/zip" }, { "gz", "application/gzip" },
+                { "wasm", "application/wasm" },
+            };
+
+            auto dot = path.find_last_of("./");
+            if(dot != std::string::npos && path[dot] == '.')
+            {
+                auto ext = path.substr(dot + 1);
+                for(auto& t : types)
+                {
+                    if(native::text::ci_equal(ext, t[0])) return t[1];
+                }
+            }
+            return "application/octet-stream";
+        }
+
+        /*!
+         *  Formats t as an HTTP date, e.g. "Sun, 06 Nov 1994 08:49:37 GMT".
+         */
+        inline std::string format_http_date(time_t t)
+        {
+            static const char* days[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+            static const char* months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+            struct tm tm;
+            gmtime_r(&t, &tm);
+
+            char buf[32];
+            auto n = snprintf(buf, sizeof(buf), "%s, %02d %s %04d %02d:%02d:%02d GMT",
+                days[tm.tm_wday], tm.tm_mday, months[tm.tm_mon], tm.tm_year + 1900, tm.tm_hour, tm.tm_min, tm.tm_sec);
+            return std::string(buf, n);
+        }
+
+        /*!
+         *  Connection timeouts in milliseconds, see http::set_timeouts(). 0 disables one.
+         *  The connection is closed when one expires; a request still being read ends with UV_ETIMEDOUT.
+         */
+        struct timeouts
+        {
+            timeouts()
+                : header(60000)
+                , body(60000)
+                , keep_alive(5000)
+                , write(60000)
+            {}
+
+            int64_t header; // request line and headers, from their first byte (or from the accept)
+            int64_t body; // between two reads of a request body
+            int64_t keep_alive; // idle persistent connection, until the next request starts
+            int64_t write; // without progress while output is waiting for the peer
+        };
+
         class client_context;
         typedef std::shared_ptr<client_context> http_client_ptr;
 
+        struct file_body;
+        class file_cache;
+
+        // Piece of response output: an owned string, or borrowed bytes kept alive by owner.
+        struct output_piece
+        {
+            output_piece(std::string&& s)
+                : str(std::move(s))
+                , data(nullptr)
+                , size(0)
+                , owner()
+            {}
+
+            output_piece(const char* d, std::size_t n, std::shared_ptr<const void> o)
+                : str()
+                , data(d)
+                , size(n)
+                , owner(std::move(o))
+            {}
+
+            const char* ptr() const { return data ? data : str.data(); }
+            std::size_t length() const { return data ? size : str.length(); }
+
+            std::string str;
+            const char* data; // borrowed if not null
+            std::size_t size;
+            std::shared_ptr<const void> owner;
+        };
+
         class response
         {
             friend class client_context;
+            friend class file_cache;
 
         private:
             response(client_context* client, native::net::tcp* socket)
@@ -136,6 +244,18 @@ namespace native
                 , socket_(socket)
                 , headers_()
                 , status_(200)
+                , keep_alive_(true)
+                , http_minor_(1)
+                , head_(false)
+                , headers_sent_(false)
+                , chunked_(false)
+                , finished_(false)
+                , needs_drain_(false)
+                , content_type_set_(false)
+                , file_(nullptr)
+                , output_()
+                , output_bytes_(0)
+                , drain_callback_()
             {
                 headers_["Content-Type"] = "text/html";
             }
@@ -144,37 +264,64 @@ namespace native
             {}
 
         public:
-            bool end(const std::string& body)
+            /*!
+             *  Sends the status line and the headers.
+             *  Without a Content-Length header the body is sent chunked (HTTP/1.1)
+             *  or delimited by closing the connection (HTTP/1.0).
+             */
+            bool write_head();
+
+            /*!
+             *  Sends a part of the body, sending the headers first if needed.
+             *  Returns false if the response is finished or if the output queued for
+             *  the connection exceeds the high-water mark: wait for on_drain() then.
+             */
+            bool write(const std::string& chunk);
+            bool write(std::string&& chunk);
+
+            /*!
+             *  Sets the callback invoked when the queued output has been written
+             *  after write() returned false.
+             */
+            void on_drain(std::function<void()> callback)
             {
-                // Content-Length
-                if(headers_.find("Content-Length") == headers_.end())
-                {
-                    std::stringstream ss;
-                    ss << body.length();
-                    headers_["Content-Length"] = ss.str();
-                }
-
-                std::stringstream response_text;
-                response_text << "HTTP/1.1 ";
-                response_text << status_ << " " << get_status_text(status_) << "\r\n";
-                for(auto h : headers_)
-                {
-                    response_text << h.first << ": " << h.second << "\r\n";
-                }
-                response_text << "\r\n";
-                response_text << body;
-
-                auto str = response_text.str();
-                return socket_->write(str.c_str(), static_cast<int>(str.length()), [=](error e) {
-                    if(e)
-                    {
-                        // TODO: handle error
-                    }
-                    // clean up
-                    client_.reset();
-                });
+                drain_callback_ = callback;
             }
 
+            /*!
+             *  Finishes the response.
+             *  The response to a HEAD request gets the headers (Content-Length included) but no body.
+             */
+            bool end();
+            bool end(const std::string& body);
+
+            /*!
+             *  Finishes the response with body, which is handed to the socket
+             *  without being copied.
+             */
+            bool end(std::string&& body);
+
+            /*!
+             *  Finishes the response with len bytes from body, which are handed to the socket without a copy.
+             *  owner (e.g. the shared buffer holding body) is kept alive until they are written.
+             */
+            bool end(const char* body, std::size_t len, std::shared_ptr<const void> owner);
+
+            /*!
+             *  Sends the file as the body and finishes the response. The data goes from the file
+             *  to the socket with sendfile() and never passes through user space.
+             *  Content-Length, Last-Modified, Accept-Ranges and Content-Type (from the extension,
+             *  unless set) are filled in; a "Range: bytes=..." request is answered with 206 or 416.
+             *  offset and length select the part of the file that is served as the whole entity.
+             *  A file that cannot be opened is answered with 404 (403, 500).
+             */
+            bool send_file(const std::string& path, std::size_t offset=0, std::size_t length=std::string::npos);
+
+            /*!
+             *  Same as above for a file opened by the caller. The response takes over fd and closes it when done.
+             */
+            bool send_file(native::fs::file_handle fd, std::size_t offset=0, std::size_t length=std::string::npos);
+
             void set_status(int status_code)
             {
                 status_ = status_code;
@@ -182,63 +329,94 @@ namespace native
 
             void set_header(const std::string& key, const std::string& value)
             {
+                if(native::text::ci_equal(key, "Content-Type")) content_type_set_ = true;
                 headers_[key] = value;
             }
 
             static std::string get_status_text(int status)
+            {
+                // "HTTP/1.1 200 OK\r\n" -> "OK"
+                auto line = get_status_line(status);
+                return std::string(line + 13, std::strlen(line) - 15);
+            }
+
+            /*!
+             *  Returns the precomputed status line, e.g. "HTTP/1.1 200 OK\r\n".
+             */
+            static const char* get_status_line(int status)
             {
                 switch(status)
                 {
-                case 100: return "Continue";
-                case 101: return "Switching Protocols";
-                case 200: return "OK";
-                case 201: return "Created";
-                case 202: return "Accepted";
-                case 203: return "Non-Authoritative Information";
-                case 204: return "No Content";
-                case 205: return "Reset Content";
-                case 206: return "Partial Content";
-                case 300: return "Multiple Choices";
-                case 301: return "Moved Permanently";
-                case 302: return "Found";
-                case 303: return "See Other";
-                case 304: return "Not Modified";
-                case 305: return "Use Proxy";
-                //case 306: return "(reserved)";
-                case 307: return "Temporary Redirect";
-                case 400: return "Bad Request";
-                case 401: return "Unauthorized";
-                case 402: return "Payment Required";
-                case 403: return "Forbidden";
-                case 404: return "Not Found";
-                case 405: return "Method Not Allowed";
-                case 406: return "Not Acceptable";
-                case 407: return "Proxy Authentication Required";
-                case 408: return "Request Timeout";
-                case 409: return "Conflict";
-                case 410: return "Gone";
-                case 411: return "Length Required";
-                case 412: return "Precondition Failed";
-                case 413: return "Request Entity Too Large";
-                case 414: return "Request-URI Too Long";
-                case 415: return "Unsupported Media Type";
-                case 416: return "Requested Range Not Satisfiable";
-                case 417: return "Expectation Failed";
-                case 500: return "Internal Server Error";
-                case 501: return "Not Implemented";
-                case 502: return "Bad Gateway";
-                case 503: return "Service Unavailable";
-                case 504: return "Gateway Timeout";
-                case 505: return "HTTP Version Not Supported";
+                case 100: return "HTTP/1.1 100 Continue\r\n";
+                case 101: return "HTTP/1.1 101 Switching Protocols\r\n";
+                case 200: return "HTTP/1.1 200 OK\r\n";
+                case 201: return "HTTP/1.1 201 Created\r\n";
+                case 202: return "HTTP/1.1 202 Accepted\r\n";
+                case 203: return "HTTP/1.1 203 Non-Authoritative Information\r\n";
+                case 204: return "HTTP/1.1 204 No Content\r\n";
+                case 205: return "HTTP/1.1 205 Reset Content\r\n";
+                case 206: return "HTTP/1.1 206 Partial Content\r\n";
+                case 300: return "HTTP/1.1 300 Multiple Choices\r\n";
+                case 301: return "HTTP/1.1 301 Moved Permanently\r\n";
+                case 302: return "HTTP/1.1 302 Found\r\n";
+                case 303: return "HTTP/1.1 303 See Other\r\n";
+                case 304: return "HTTP/1.1 304 Not Modified\r\n";
+                case 305: return "HTTP/1.1 305 Use Proxy\r\n";
+                //case 306: return "HTTP/1.1 306 (reserved)\r\n";
+                case 307: return "HTTP/1.1 307 Temporary Redirect\r\n";
+                case 400: return "HTTP/1.1 400 Bad Request\r\n";
+                case 401: return "HTTP/1.1 401 Unauthorized\r\n";
+                case 402: return "HTTP/1.1 402 Payment Required\r\n";
+                case 403: return "HTTP/1.1 403 Forbidden\r\n";
+                case 404: return "HTTP/1.1 404 Not Found\r\n";
+                case 405: return "HTTP/1.1 405 Method Not Allowed\r\n";
+                case 406: return "HTTP/1.1 406 Not Acceptable\r\n";
+                case 407: return "HTTP/1.1 407 Proxy Authentication Required\r\n";
+                case 408: return "HTTP/1.1 408 Request Timeout\r\n";
+                case 409: return "HTTP/1.1 409 Conflict\r\n";
+                case 410: return "HTTP/1.1 410 Gone\r\n";
+                case 411: return "HTTP/1.1 411 Length Required\r\n";
+                case 412: return "HTTP/1.1 412 Precondition Failed\r\n";
+                case 413: return "HTTP/1.1 413 Request Entity Too Large\r\n";
+                case 414: return "HTTP/1.1 414 Request-URI Too Long\r\n";
+                case 415: return "HTTP/1.1 415 Unsupported Media Type\r\n";
+                case 416: return "HTTP/1.1 416 Requested Range Not Satisfiable\r\n";
+                case 417: return "HTTP/1.1 417 Expectation Failed\r\n";
+                case 500: return "HTTP/1.1 500 Internal Server Error\r\n";
+                case 501: return "HTTP/1.1 501 Not Implemented\r\n";
+                case 502: return "HTTP/1.1 502 Bad Gateway\r\n";
+                case 503: return "HTTP/1.1 503 Service Unavailable\r\n";
+                case 504: return "HTTP/1.1 504 Gateway Timeout\r\n";
+                case 505: return "HTTP/1.1 505 HTTP Version Not Supported\r\n";
                 default: throw response_exception("Not supported status code.");
                 }
             }
 
         private:
-            http_client_ptr client_;
+            void serialize_head(std::size_t content_length, const std::string* fields=nullptr);
+            bool end_serialized(const std::string& fields, const char* body, std::size_t len, std::shared_ptr<const void> owner);
+            void push(std::string&& piece);
+            void push(const char* data, std::size_t len, std::shared_ptr<const void> owner);
+            void send_file_head(const std::string& path, const uv_statbuf_t& st, std::size_t offset, std::size_t length, std::size_t& begin, std::size_t& size);
+            static int parse_range(const std::string& value, std::size_t total, std::size_t& first, std::size_t& last);
+
+        private:
+            client_context* client_;
             native::net::tcp* socket_;
             std::map<std::string, std::string, native::text::ci_less> headers_;
             int status_;
+            bool keep_alive_;
+            int http_minor_;
+            bool head_; // answers a HEAD request: the headers go out, the body does not
+            bool headers_sent_;
+            bool chunked_;
+            bool finished_;
+            bool needs_drain_;
+            bool content_type_set_;
+            file_body* file_; // send_file() in progress
+            std::vector<output_piece> output_;
+            std::size_t output_bytes_;
+            std::function<void()> drain_callback_;
         };
 
         class request
@@ -250,6 +428,11 @@ namespace native
                 : url_()
                 , headers_()
                 , body_("")
+                , data_callback_()
+                , end_callback_()
+                , dispatched_(false)
+                , complete_(false)
+                , streamed_(false)
             {
             }
 
@@ -279,86 +462,201 @@ namespace native
                 return false;
             }
 
-            std::string get_body (void)
+            /*!
+             *  Returns the request body, buffered by default (see http::set_body_buffering()).
+             *  Must not be called for a body streamed to on_data(): is_body_streamed() tells.
+             */
+            const std::string& get_body() const
             {
+                assert(!streamed_ && "request body is streamed: read it with on_data()");
                 return body_;
             }
 
+            /*!
+             *  Whether the body is delivered through on_data()/on_end() instead of get_body().
+             */
+            bool is_body_streamed() const { return streamed_; }
+
+            /*!
+             *  Sets the callback that receives the request body as it arrives.
+             *  buf points into the read buffer and is only valid during the callback.
+             */
+            void on_data(std::function<void(const char* buf, std::size_t len)> callback)
+            {
+                data_callback_ = callback;
+            }
+
+            /*!
+             *  Sets the callback invoked once the whole body is received.
+             *  e is set if the connection ended before the body was complete.
+             */
+            void on_end(std::function<void(native::error e)> callback)
+            {
+                end_callback_ = callback;
+            }
+
         private:
             url_obj url_;
             std::map<std::string, std::string, native::text::ci_less> headers_;
             std::string body_;
             std::string default_value_;
+            std::function<void(const char* buf, std::size_t len)> data_callback_;
+            std::function<void(native::error e)> end_callback_;
+            bool dispatched_;
+            bool complete_;
+            bool streamed_; // has a body, and the server streams bodies
+        };
+
+        // Body of a response::send_file() response: the file is opened and fstat()'d in the threadpool,
+        // then sendfile() copies it to the socket once everything queued before it is written.
+        struct file_body
+        {
+            uv_fs_t req;
+            uv_poll_t poll; // waits for the socket to become writable when sendfile() would block
+            client_context* client;
+            response* res;
+            std::string path;
+            native::fs::file_handle file;
+            bool owns_file;
+            std::size_t offset;
+            std::size_t length;
+            std::size_t remaining;
+            int poll_fd; // dup() of the socket, -1 until polling is needed
+            bool ready; // headers queued
+            bool sending; // sendfile() or poll in progress
         };
 
         class client_context
         {
             friend class http;
+            friend class response;
 
         private:
-            client_context(native::net::tcp* server)
+            typedef std::function<void(request&, response&)> callback_type;
+
+            // output queued per connection before response::write() asks for back-off
+            static const std::size_t high_water_mark = 64 * 1024;
+
+            static const std::size_t max_write_bufs = 16;
+            static const std::size_t max_spare_buffers = 4;
+            static const std::size_t max_spare_capacity = 4096;
+
+            // bytes handed to one sendfile() call
+            static const std::size_t max_sendfile_chunk = 1024 * 1024 * 1024;
+
+            // the timeout being watched while reading
+            enum read_phase
+            {
+                read_none,
+                read_header,
+                read_body,
+                read_idle
+            };
+
+            client_context(native::net::tcp* server, std::set<client_context*>* registry, std::size_t max_requests, std::size_t max_body_size, const timeouts& t)
                 : socket_(nullptr)
                 , parser_()
                 , was_header_value_(true)
                 , last_header_field_()
                 , last_header_value_()
                 , parser_settings_()
-                , request_(nullptr)
-                , response_(nullptr)
-                , callback_lut_(new callbacks(1))
+                , transactions_()
+                , parsing_(nullptr)
+                , output_()
+                , queued_bytes_(0)
+                , write_reqs_()
+                , spare_buffers_()
+                , callback_()
+                , registry_(registry)
+                , max_requests_(max_requests)
+                , max_body_size_(max_body_size)
+                , num_requests_(0)
+                , keep_parsing_(true)
+                , closing_(false)
+                , broken_(false)
+                , in_execute_(false)
+                , timed_out_(false)
+                , socket_closed_(false)
+                , loop_(server->get()->loop)
+                , timeouts_(t)
+                , read_phase_(read_none)
+                , read_timer_()
+                , write_timer_()
             {
                 //printf("request() %x callback_=%x\n", this, callback_);
                 assert(server);
 
+                // the connection stays on the loop of the listener that accepted it.
+                socket_ = std::shared_ptr<native::net::tcp>(new native::net::tcp(native::internal::alloc_handle<uv_tcp_t>()));
+                uv_tcp_init(loop_, socket_->get<uv_tcp_t>());
+
                 // TODO: check error
-                socket_ = std::shared_ptr<native::net::tcp> (new native::net::tcp);
                 server->accept(socket_.get());
+                if(registry_) registry_->insert(this);
+
+#ifdef SO_NOSIGPIPE
+                // a write to a peer that went away fails with EPIPE instead of raising SIGPIPE (see ignore_sigpipe()).
+                int on = 1;
+                setsockopt(socket_->fd(), SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+
+                read_timer_.callback = write_timer_.callback = [](native::internal::timer_wheel::entry* e) {
+                    reinterpret_cast<client_context*>(e->data)->on_timeout();
+                };
+                read_timer_.data = write_timer_.data = this;
             }
 
         public:
             ~client_context()
             {
-                if(request_)
-                {
-                    delete request_;
-                    request_ = nullptr;
-                }
+                if(registry_) registry_->erase(this);
 
-                if(response_)
-                {
-                    delete response_;
-                    response_ = nullptr;
-                }
+                auto& wheel = native::internal::timer_wheel::get(loop_);
+                wheel.stop(&read_timer_);
+                wheel.stop(&write_timer_);
 
-                if(callback_lut_)
+                for(auto& t : transactions_)
                 {
-                    delete callback_lut_;
-                    callback_lut_ = nullptr;
+                    delete t.first;
+                    delete t.second;
                 }
+                transactions_.clear();
 
-                if(socket_.use_count())
-                {
-                    socket_->close([=](){});
-                }
+                for(auto req : write_reqs_) delete req;
+                write_reqs_.clear();
+
+                if(socket_.use_count()) close_socket();
             }
 
         private:
-            bool parse(std::function<void(request&, response&)> callback)
+            bool parse(callback_type callback)
             {
-                request_ = new request;
-                response_ = new response(this, socket_.get());
-
                 http_parser_init(&parser_, HTTP_REQUEST);
                 parser_.data = this;
 
-                // store callback object
-                callbacks::store(callback_lut_, 0, callback);
+                callback_ = std::move(callback);
 
+                parser_settings_.on_message_begin = [](http_parser* parser) {
+                    auto client = reinterpret_cast<client_context*>(parser->data);
+
+                    // a non-persistent request was already received: ignore the rest.
+                    if(!client->keep_parsing_) return 1;
+
+                    if(client->read_phase_ != read_header) client->watch_read(read_header);
+
+                    client->parsing_ = new request;
+                    client->transactions_.push_back(std::make_pair(client->parsing_, new response(client, client->socket_.get())));
+
+                    client->was_header_value_ = true;
+                    client->last_header_field_.clear();
+                    client->last_header_value_.clear();
+                    return 0;
+                };
                 parser_settings_.on_url = [](http_parser* parser, const char *at, size_t len) {
                     auto client = reinterpret_cast<client_context*>(parser->data);
 
                     //  TODO: from_buf() can throw an exception: check
-                    client->request_->url_.from_buf(at, len);
+                    client->parsing_->url_.from_buf(at, len);
 
                     return 0;
                 };
@@ -371,7 +669,7 @@ namespace native
                         if(!client->last_header_field_.empty())
                         {
                             // add new entry
-                            client->request_->headers_[client->last_header_field_] = client->last_header_value_;
+                            client->parsing_->headers_[client->last_header_field_] = client->last_header_value_;
                             client->last_header_value_.clear();
                         }
 
@@ -406,7 +704,43 @@ namespace native
                     // add last entry if any
                     if(!client->last_header_field_.empty()) {
                         // add new entry
-                        client->request_->headers_[client->last_header_field_] = client->last_header_value_;
+                        client->parsing_->headers_[client->last_header_field_] = client->last_header_value_;
+                    }
+
+                    // HTTP/1.1 defaults to keep-alive, HTTP/1.0 needs "Connection: keep-alive".
+                    auto res = client->transactions_.back().second;
+                    res->keep_alive_ = http_should_keep_alive(parser) != 0;
+                    res->http_minor_ = parser->http_minor;
+                    res->head_ = parser->method == HTTP_HEAD;
+
+                    ++client->num_requests_;
+                    if(!client->keep_parsing_) res->keep_alive_ = false; // shutting down
+                    client->watch_read(read_body);
+                    if(client->max_requests_ && client->num_requests_ >= client->max_requests_) res->keep_alive_ = false;
+                    if(!res->keep_alive_) client->keep_parsing_ = false;
+
+                    if(client->max_body_size_)
+                    {
+                        // buffered: the body is handed over with the request on completion.
+                        if(!(parser->flags & F_CHUNKED) && parser->content_length != ULLONG_MAX)
+                        {
+                            if(parser->content_length > client->max_body_size_) return client->reject_body();
+                            client->parsing_->body_.reserve(static_cast<std::size_t>(parser->content_length));
+                        }
+                    }
+
+                    // queued like any response output so it never overtakes earlier responses.
+                    if(parser->http_minor >= 1 && native::text::ci_equal(client->parsing_->get_header("Expect"), "100-continue"))
+                    {
+                        res->push(std::string("HTTP/1.1 100 Continue\r\n\r\n"));
+                        client->flush();
+                    }
+
+                    if(!client->max_body_size_)
+                    {
+                        // streaming: the handler attaches on_data()/on_end() to consume the body.
+                        client->parsing_->streamed_ = (parser->flags & F_CHUNKED) || (parser->content_length > 0 && parser->content_length != ULLONG_MAX);
+                        client->dispatch();
                     }
 
                     return 0; // 1 to prevent reading of message body.
@@ -414,87 +748,1523 @@ namespace native
                 parser_settings_.on_body = [](http_parser* parser, const char* at, size_t len) {
                     //printf("on_body, len of 'char* at' is %d\n", len);
                     auto client = reinterpret_cast<client_context*>(parser->data);
-                    client->request_->body_ = std::string(at, len);
+                    auto req = client->parsing_;
+                    client->watch_read(read_body);
+
+                    if(client->max_body_size_)
+                    {
+                        if(req->body_.length() + len > client->max_body_size_) return client->reject_body();
+                        req->body_.append(at, len);
+                    }
+                    else if(req->data_callback_)
+                    {
+                        req->data_callback_(at, len);
+                    }
                     return 0;
                 };
                 parser_settings_.on_message_complete = [](http_parser* parser) {
                     //printf("on_message_complete, so invoke the callback.\n");
                     auto client = reinterpret_cast<client_context*>(parser->data);
-                    // invoke stored callback object
-                    callbacks::invoke<decltype(callback)>(client->callback_lut_, 0, *client->request_, *client->response_);
-                    return 1; // 0 or 1?
+                    auto req = client->parsing_;
+                    req->complete_ = true;
+                    client->watch_read(read_none);
+
+                    if(!req->dispatched_) client->dispatch();
+                    else if(req->end_callback_) req->end_callback_(native::error());
+
+                    // the response may be waiting for the request to complete.
+                    client->parsing_ = nullptr;
+                    client->flush();
+                    return 0; // keep parsing pipelined requests.
                 };
 
                 socket_->read_start([=](const char* buf, int len){
-                    if (buf == 0x00 && len == -1) {
-                        response_->set_status(500);
-                    } else {
-                        http_parser_execute(&parser_, &parser_settings_, buf, len);
+                    if(len < 0)
+                    {
+                        // EOF (or read error)
+                        on_eof();
+                    }
+                    else if(len > 0 && (keep_parsing_ || parsing_))
+                    {
+                        in_execute_ = true;
+                        auto nparsed = http_parser_execute(&parser_, &parser_settings_, buf, len);
+                        in_execute_ = false;
+
+                        if(keep_parsing_ && nparsed != static_cast<size_t>(len))
+                        {
+                            // malformed request: answer the completed ones and close.
+                            on_eof();
+                        }
+                        else
+                        {
+                            try_close();
+                        }
                     }
                 });
 
+                // the first request must arrive within the header timeout
+                watch_read(read_header);
                 return true;
             }
 
-        private:
-            http_parser parser_;
-            http_parser_settings parser_settings_;
-            bool was_header_value_;
-            std::string last_header_field_;
-            std::string last_header_value_;
+            void dispatch()
+            {
+                auto& t = transactions_.back();
+                t.first->dispatched_ = true;
 
-            std::shared_ptr<native::net::tcp> socket_;
-            request* request_;
-            response* response_;
+                // invoke stored callback object
+                callback_(*t.first, *t.second);
+            }
 
-            callbacks* callback_lut_;
-        };
+            // Body larger than the buffering limit: answer 413 and stop reading.
+            int reject_body()
+            {
+                auto req = parsing_;
+                auto res = transactions_.back().second;
+                req->body_.clear();
+                req->complete_ = true;
+                parsing_ = nullptr;
+                keep_parsing_ = false;
+                watch_read(read_none);
+
+                res->keep_alive_ = false;
+                res->set_status(413);
+                res->end();
+                return -1; // stops the parser
+            }
 
-        class http
-        {
-        public:
-            http()
-                : socket_(new native::net::tcp)
+            // Called after the response queued output, in any order. Output is written in
+            // request order: later responses keep theirs until the earlier ones are finished.
+            bool send(response* res, bool last)
             {
+                if(last)
+                {
+                    res->finished_ = true;
+                    flush();
+                    return true;
+                }
+
+                flush();
+
+                auto queued = res->output_bytes_;
+                if(transactions_.front().second == res) queued += queued_bytes_;
+                res->needs_drain_ = queued > high_water_mark;
+                return !res->needs_drain_;
             }
 
-            virtual ~http()
+            void flush()
             {
-                if(socket_)
+                while(!transactions_.empty())
                 {
-                    socket_->close([](){});
+                    auto req = transactions_.front().first;
+                    auto res = transactions_.front().second;
+
+                    if(!res->output_.empty())
+                    {
+                        write(res->output_);
+                        res->output_.clear();
+                        res->output_bytes_ = 0;
+                    }
+
+                    if(res->file_ && !send_file_body(res)) break;
+                    if(!res->finished_ || !req->complete_) break;
+
+                    // anything pipelined after a non-persistent response is dropped.
+                    if(!res->keep_alive_) closing_ = broken_ = true;
+
+                    delete req;
+                    delete res;
+                    transactions_.pop_front();
                 }
+
+                // no more requests to read and none left to answer
+                if(!keep_parsing_ && !parsing_ && transactions_.empty()) closing_ = true;
+
+                // waiting for the next request on a persistent connection
+                if(keep_parsing_ && !parsing_ && transactions_.empty() && read_phase_ == read_none) watch_read(read_idle);
+
+                if(closing_ && !socket_closed_) socket_->read_stop();
+                try_close();
             }
 
-        public:
-            static std::shared_ptr<http> create_server(const std::string& ip, int port, std::function<void(request&, response&)> callback)
+            // Takes no new requests: the ones in progress are answered, then the connection closes.
+            void shutdown()
             {
-                auto server = std::shared_ptr<http>(new http);
-                if(server->listen(ip, port, callback)) return server;
-                return nullptr;
+                registry_ = nullptr;
+                keep_parsing_ = false;
+                for(auto& t : transactions_)
+                {
+                    if(!t.second->headers_sent_) t.second->keep_alive_ = false;
+                }
+                flush();
             }
 
-            bool listen(const std::string& ip, int port, std::function<void(request&, response&)> callback)
+            struct write_req
+            {
+                uv_write_t req;
+                client_context* client;
+                std::size_t pieces;
+                std::size_t bytes;
+            };
+
+            // Hands the pieces to one uv_write() each (up to max_write_bufs buffers):
+            // header blocks and bodies go out as separate uv_buf_t's without being copied.
+            void write(std::vector<output_piece>& pieces)
             {
-                if(!socket_->bind(ip, port)) return false;
+                if(broken_) return;
 
-                if(!socket_->listen([=](error e) {
-                    if(e)
+                if(!write_timer_.armed()) watch_write(true);
+
+                uv_buf_t bufs[max_write_bufs];
+                for(std::size_t i = 0; i < pieces.size();)
+                {
+                    auto req = acquire_write_req();
+                    req->pieces = 0;
+                    req->bytes = 0;
+
+                    // keep the buffers alive until uv_write() completes: writes complete in order.
+                    for(; i < pieces.size() && req->pieces < max_write_bufs; ++i)
                     {
-                        // TODO: handle client connection error
+                        output_.push_back(std::move(pieces[i]));
+                        auto& piece = output_.back();
+                        bufs[req->pieces++] = uv_buf_t { const_cast<char*>(piece.ptr()), piece.length() };
+                        req->bytes += piece.length();
                     }
-                    else
+                    queued_bytes_ += req->bytes;
+
+                    if(uv_write(&req->req, socket_->get<uv_stream_t>(), bufs, static_cast<int>(req->pieces), [](uv_write_t* r, int status) {
+                        auto req = reinterpret_cast<write_req*>(r);
+                        req->client->on_write(req, status?error(uv_last_error(r->handle->loop)):error());
+                    }))
                     {
-                        auto client = new client_context(socket_.get());
-                        client->parse(callback);
+                        output_.erase(output_.end() - req->pieces, output_.end());
+                        queued_bytes_ -= req->bytes;
+                        write_reqs_.push_back(req);
+                        broken_ = true;
+                        closing_ = true;
+                        return;
+                    }
+                }
+            }
+
+            void on_write(write_req* req, error e)
+            {
+                for(std::size_t i = 0; i < req->pieces; ++i)
+                {
+                    // recycle small buffers for the next header blocks.
+                    auto& str = output_.front().str;
+                    if(!output_.front().data && str.capacity() <= max_spare_capacity && spare_buffers_.size() < max_spare_buffers)
+                    {
+                        str.clear();
+                        spare_buffers_.push_back(std::move(str));
                     }
-                })) return false;
+                    output_.pop_front();
+                }
+                queued_bytes_ -= req->bytes;
+                write_reqs_.push_back(req);
+                watch_write(queued_bytes_ > 0); // progress: rearmed
+
+                if(e)
+                {
+                    broken_ = true;
+                    closing_ = true;
+                }
+                else
+                {
+                    // the drain callback may finish the response: stay alive until it returns.
+                    in_execute_ = true;
+                    drain();
+                    in_execute_ = false;
+                }
+
+                // a send_file() body goes out once the output before it is written.
+                if(!transactions_.empty() && transactions_.front().second->file_) flush();
+                else try_close();
+            }
+
+            request* find_request(response* res)
+            {
+                for(auto& t : transactions_)
+                {
+                    if(t.second == res) return t.first;
+                }
+                return nullptr;
+            }
 
+            bool open_file(response* res, const std::string& path, native::fs::file_handle fd, std::size_t offset, std::size_t length)
+            {
+                auto body = new file_body;
+                body->client = this;
+                body->res = res;
+                body->path = path;
+                body->file = fd;
+                body->owns_file = fd >= 0;
+                body->offset = offset;
+                body->length = length;
+                body->remaining = 0;
+                body->poll_fd = -1;
+                body->ready = false;
+                body->sending = false;
+
+                auto loop = loop_;
+                int r = path.empty() ? uv_fs_fstat(loop, &body->req, fd, on_file_stat) : uv_fs_open(loop, &body->req, path.c_str(), O_RDONLY, 0, on_file_open);
+                if(r)
+                {
+                    delete body;
+                    return false;
+                }
+                res->file_ = body;
                 return true;
             }
 
-        private:
-            std::shared_ptr<native::net::tcp> socket_;
+            static void on_file_open(uv_fs_t* req)
+            {
+                auto body = reinterpret_cast<file_body*>(req);
+                auto err = req->errorno;
+                auto fd = static_cast<native::fs::file_handle>(req->result);
+                uv_fs_req_cleanup(req);
+
+                if(err)
+                {
+                    body->client->fail_file(body, (err == UV_ENOENT || err == UV_ENOTDIR) ? 404 : err == UV_EACCES ? 403 : 500);
+                    return;
+                }
+
+                body->file = fd;
+                body->owns_file = true;
+                if(uv_fs_fstat(req->loop, req, fd, on_file_stat)) body->client->fail_file(body, 500);
+            }
+
+            static void on_file_stat(uv_fs_t* req)
+            {
+                auto body = reinterpret_cast<file_body*>(req);
+                auto client = body->client;
+                if(req->errorno || !S_ISREG(reinterpret_cast<const uv_statbuf_t*>(req->ptr)->st_mode))
+                {
+                    auto status = req->errorno ? 500 : 404;
+                    uv_fs_req_cleanup(req);
+                    client->fail_file(body, status);
+                    return;
+                }
+
+                std::size_t begin = 0, size = 0;
+                body->res->send_file_head(body->path, *reinterpret_cast<const uv_statbuf_t*>(req->ptr), body->offset, body->length, begin, size);
+                uv_fs_req_cleanup(req);
+
+                body->offset = begin;
+                body->remaining = size;
+                body->ready = true;
+                client->flush();
+            }
+
+            // Nothing was sent yet: answer with an error status instead.
+            void fail_file(file_body* body, int status)
+            {
+                auto res = body->res;
+                res->file_ = nullptr;
+                if(body->owns_file) ::close(body->file);
+                delete body;
+
+                res->set_status(status);
+                res->end();
+            }
+
+            // Sends the file body of the front response. Returns true once it is done (or dropped).
+            bool send_file_body(response* res)
+            {
+                auto body = res->file_;
+                if(!body->ready || body->sending) return false;
+
+                if(broken_ || !body->remaining)
+                {
+                    res->file_ = nullptr;
+                    res->finished_ = true;
+                    release_file(body);
+                    return true;
+                }
+
+                // the headers (and earlier output) must be on the wire first
+                if(!output_.empty()) return false;
+
+                body->sending = true;
+                if(uv_fs_sendfile(loop_, &body->req, socket_->fd(), body->file,
+                    body->offset, body->remaining < max_sendfile_chunk ? body->remaining : max_sendfile_chunk, on_sendfile))
+                {
+                    body->sending = false;
+                    broken_ = closing_ = true;
+                    return send_file_body(res);
+                }
+                return false;
+            }
+
+            static void on_sendfile(uv_fs_t* req)
+            {
+                auto body = reinterpret_cast<file_body*>(req);
+                auto client = body->client;
+                auto err = req->errorno;
+                auto n = req->result;
+                uv_fs_req_cleanup(req);
+                body->sending = false;
+
+                // the connection timed out meanwhile: its socket could not be closed under sendfile().
+                if(client->timed_out_) client->close_socket();
+
+                if(err == UV_EAGAIN)
+                {
+                    // socket buffer full: continue when it is writable.
+                    if(client->poll_writable(body)) return;
+                }
+                else if(!err && n > 0)
+                {
+                    body->offset += n;
+                    body->remaining -= n;
+                }
+
+                // error, or the file shrank below the announced Content-Length
+                if(err || n <= 0) client->broken_ = client->closing_ = true;
+                client->flush();
+            }
+
+            bool poll_writable(file_body* body)
+            {
+                if(body->poll_fd < 0)
+                {
+                    // the socket itself is already watched by the loop: poll a duplicate.
+                    auto fd = ::dup(socket_->fd());
+                    if(fd < 0) return false;
+                    if(uv_poll_init(loop_, &body->poll, fd))
+                    {
+                        ::close(fd);
+                        return false;
+                    }
+                    body->poll_fd = fd;
+                    body->poll.data = body;
+                }
+
+                body->sending = true;
+                watch_write(true);
+                if(uv_poll_start(&body->poll, UV_WRITABLE, [](uv_poll_t* p, int status, int) {
+                    auto body = reinterpret_cast<file_body*>(p->data);
+                    uv_poll_stop(p);
+                    body->sending = false;
+                    body->client->watch_write(false);
+                    if(status) body->client->broken_ = body->client->closing_ = true;
+                    body->client->flush();
+                }))
+                {
+                    body->sending = false;
+                    watch_write(false);
+                    return false;
+                }
+                return true;
+            }
+
+            static void release_file(file_body* body)
+            {
+                if(body->owns_file) ::close(body->file);
+
+                if(body->poll_fd < 0)
+                {
+                    delete body;
+                    return;
+                }
+
+                uv_close(reinterpret_cast<uv_handle_t*>(&body->poll), [](uv_handle_t* h) {
+                    auto body = reinterpret_cast<file_body*>(h->data);
+                    ::close(body->poll_fd);
+                    delete body;
+                });
+            }
+
+            write_req* acquire_write_req()
+            {
+                if(write_reqs_.empty())
+                {
+                    auto req = new write_req;
+                    req->client = this;
+                    return req;
+                }
+
+                auto req = write_reqs_.back();
+                write_reqs_.pop_back();
+                return req;
+            }
+
+            std::string acquire_buffer()
+            {
+                if(spare_buffers_.empty()) return std::string();
+
+                auto str = std::move(spare_buffers_.back());
+                spare_buffers_.pop_back();
+                return str;
+            }
+
+            void drain()
+            {
+                if(transactions_.empty() || queued_bytes_ > high_water_mark) return;
+
+                auto res = transactions_.front().second;
+                if(res->needs_drain_)
+                {
+                    res->needs_drain_ = false;
+                    if(res->drain_callback_)
+                    {
+                        auto callback = res->drain_callback_;
+                        callback();
+                    }
+                }
+            }
+
+            void on_eof(native::error e=native::error(UV_EOF))
+            {
+                keep_parsing_ = false;
+                closing_ = true;
+                watch_read(read_none);
+
+                if(parsing_)
+                {
+                    if(parsing_->dispatched_)
+                    {
+                        // the handler still owns the response: report the truncated body.
+                        // It may end the response: stay alive until it returns.
+                        parsing_->complete_ = true;
+                        if(parsing_->end_callback_)
+                        {
+                            auto executing = in_execute_;
+                            in_execute_ = true;
+                            parsing_->end_callback_(e);
+                            in_execute_ = executing;
+                        }
+                    }
+                    else
+                    {
+                        // drop the request that will never complete
+                        delete transactions_.back().first;
+                        delete transactions_.back().second;
+                        transactions_.pop_back();
+                    }
+                    parsing_ = nullptr;
+                }
+
+                flush();
+            }
+
+            // Arms the timeout of the given phase (in the connection's timer wheel), or disarms it.
+            void watch_read(read_phase phase)
+            {
+                int64_t timeout = 0;
+                switch(phase)
+                {
+                    case read_header: timeout = timeouts_.header; break;
+                    case read_body: timeout = timeouts_.body; break;
+                    case read_idle: timeout = timeouts_.keep_alive; break;
+                    default: break;
+                }
+
+                read_phase_ = phase;
+                auto& wheel = native::internal::timer_wheel::get(loop_);
+                if(timeout > 0) wheel.start(&read_timer_, timeout);
+                else wheel.stop(&read_timer_);
+            }
+
+            void watch_write(bool pending)
+            {
+                auto& wheel = native::internal::timer_wheel::get(loop_);
+                if(pending && timeouts_.write > 0) wheel.start(&write_timer_, timeouts_.write);
+                else wheel.stop(&write_timer_);
+            }
+
+            // The peer is too slow: drop what is left and close.
+            void on_timeout()
+            {
+                broken_ = true;
+                timed_out_ = true;
+                socket_->read_stop();
+                watch_write(false);
+
+                // a file body waiting for the socket to drain is dropped by flush().
+                auto body = transactions_.empty() ? nullptr : transactions_.front().second->file_;
+                if(body && body->sending && body->poll_fd >= 0 && uv_is_active(reinterpret_cast<uv_handle_t*>(&body->poll)))
+                {
+                    uv_poll_stop(&body->poll);
+                    body->sending = false;
+                }
+
+                // uv_close() fails the queued writes with ECANCELED without touching the socket;
+                // a sendfile() still running on the thread pool closes it when it returns.
+                if(!body || !body->sending) close_socket();
+                on_eof(native::error(UV_ETIMEDOUT));
+            }
+
+            void close_socket()
+            {
+                if(socket_closed_) return;
+                socket_closed_ = true;
+                socket_->close([](){});
+            }
+
+            void try_close()
+            {
+                // never while http_parser_execute() is still using parser_
+                if(!in_execute_ && closing_ && transactions_.empty() && output_.empty())
+                {
+                    // clean up
+                    delete this;
+                }
+            }
+
+        private:
+            http_parser parser_;
+            http_parser_settings parser_settings_;
+            bool was_header_value_;
+            std::string last_header_field_;
+            std::string last_header_value_;
+
+            std::shared_ptr<native::net::tcp> socket_;
+            std::deque<std::pair<request*, response*>> transactions_;
+            request* parsing_;
+            std::deque<output_piece> output_;
+            std::size_t queued_bytes_;
+            std::vector<write_req*> write_reqs_;
+            std::vector<std::string> spare_buffers_;
+
+            callback_type callback_;
+            std::set<client_context*>* registry_;
+
+            std::size_t max_requests_;
+            std::size_t max_body_size_;
+            std::size_t num_requests_;
+            bool keep_parsing_;
+            bool closing_;
+            bool broken_;
+            bool in_execute_;
+            bool timed_out_;
+            bool socket_closed_;
+            uv_loop_t* loop_;
+
+            timeouts timeouts_;
+            read_phase read_phase_;
+            native::internal::timer_wheel::entry read_timer_;
+            native::internal::timer_wheel::entry write_timer_;
+        };
+
+        inline bool response::write_head()
+        {
+            if(headers_sent_ || finished_ || file_) return false;
+            headers_sent_ = true;
+
+            if(headers_.find("Content-Length") == headers_.end())
+            {
+                // the body length is not known: chunk it, or close the connection for HTTP/1.0.
+                if(http_minor_ >= 1) chunked_ = true;
+                else keep_alive_ = false;
+            }
+
+            serialize_head(std::string::npos);
+            client_->send(this, false);
+            return true;
+        }
+
+        inline bool response::write(const std::string& chunk)
+        {
+            return write(std::string(chunk));
+        }
+
+        inline bool response::write(std::string&& chunk)
+        {
+            if(finished_ || file_) return false;
+            if(!headers_sent_) write_head();
+            if(chunk.empty() || head_) return !needs_drain_; // an empty chunk would end the body
+
+            if(chunked_)
+            {
+                char size_line[24];
+                auto n = snprintf(size_line, sizeof(size_line), "%zx\r\n", chunk.length());
+                push(std::string(size_line, n));
+                push(std::move(chunk));
+                push(std::string("\r\n"));
+            }
+            else
+            {
+                push(std::move(chunk));
+            }
+            return client_->send(this, false);
+        }
+
+        inline bool response::end()
+        {
+            if(finished_ || file_) return false;
+            if(!headers_sent_) return end(std::string());
+
+            if(chunked_ && !head_) push(std::string("0\r\n\r\n"));
+            client_->send(this, true);
+            return true;
+        }
+
+        inline bool response::end(const std::string& body)
+        {
+            return end(std::string(body));
+        }
+
+        inline bool response::end(std::string&& body)
+        {
+            if(finished_ || file_) return false;
+
+            if(headers_sent_)
+            {
+                write(std::move(body));
+                return end();
+            }
+
+            headers_sent_ = true;
+            serialize_head(body.length());
+            if(!head_) push(std::move(body));
+            client_->send(this, true);
+            return true;
+        }
+
+        inline bool response::end(const char* body, std::size_t len, std::shared_ptr<const void> owner)
+        {
+            if(finished_ || file_) return false;
+
+            if(!headers_sent_)
+            {
+                headers_sent_ = true;
+                serialize_head(len);
+                if(!head_) push(body, len, std::move(owner));
+            }
+            else if(len && !head_)
+            {
+                if(chunked_)
+                {
+                    char size_line[24];
+                    push(std::string(size_line, snprintf(size_line, sizeof(size_line), "%zx\r\n", len)));
+                    push(body, len, std::move(owner));
+                    push(std::string("\r\n0\r\n\r\n"));
+                }
+                else
+                {
+                    push(body, len, std::move(owner));
+                }
+            }
+            else if(chunked_ && !head_)
+            {
+                push(std::string("0\r\n\r\n"));
+            }
+
+            client_->send(this, true);
+            return true;
+        }
+
+        // Finishes the response with header fields serialized beforehand, e.g. those of a file_cache entry.
+        inline bool response::end_serialized(const std::string& fields, const char* body, std::size_t len, std::shared_ptr<const void> owner)
+        {
+            if(headers_sent_ || finished_ || file_) return false;
+
+            headers_sent_ = true;
+            serialize_head(std::string::npos, &fields);
+            if(!head_) push(body, len, std::move(owner));
+            client_->send(this, true);
+            return true;
+        }
+
+        inline bool response::send_file(const std::string& path, std::size_t offset, std::size_t length)
+        {
+            if(headers_sent_ || finished_ || file_ || path.empty()) return false;
+            return client_->open_file(this, path, -1, offset, length);
+        }
+
+        inline bool response::send_file(native::fs::file_handle fd, std::size_t offset, std::size_t length)
+        {
+            if(headers_sent_ || finished_ || file_ || fd < 0) return false;
+            return client_->open_file(this, std::string(), fd, offset, length);
+        }
+
+        // Queues the headers for a file body; begin and size receive the part of the file to send.
+        inline void response::send_file_head(const std::string& path, const uv_statbuf_t& st, std::size_t offset, std::size_t length, std::size_t& begin, std::size_t& size)
+        {
+            auto file_size = static_cast<std::size_t>(st.st_size);
+            begin = std::min(offset, file_size);
+            auto total = std::min(length, file_size - begin);
+            size = total;
+
+            auto req = client_->find_request(this);
+            std::size_t first = 0, last = 0;
+            if(status_ == 200 && req && !req->get_header("Range").empty())
+            {
+                char value[64];
+                switch(parse_range(req->get_header("Range"), total, first, last))
+                {
+                case 0:
+                    status_ = 416;
+                    headers_["Content-Range"] = std::string(value, snprintf(value, sizeof(value), "bytes */%zu", total));
+                    size = 0;
+                    break;
+                case 1:
+                    status_ = 206;
+                    headers_["Content-Range"] = std::string(value, snprintf(value, sizeof(value), "bytes %zu-%zu/%zu", first, last, total));
+                    begin += first;
+                    size = last - first + 1;
+                    break;
+                default:
+                    break; // not understood: send the whole entity
+                }
+            }
+
+            headers_["Accept-Ranges"] = "bytes";
+            if(headers_.find("Last-Modified") == headers_.end()) headers_["Last-Modified"] = format_http_date(st.st_mtime);
+            if(!content_type_set_ && !path.empty()) headers_["Content-Type"] = get_mime_type(path);
+            headers_.erase("Content-Length");
+
+            headers_sent_ = true;
+            serialize_head(size);
+            if(head_) size = 0; // same headers as GET, no sendfile()
+        }
+
+        // Parses a single "bytes=first-last", "bytes=first-" or "bytes=-suffix" range.
+        // Returns 1 if it is satisfiable, 0 if not (416), -1 if the header is ignored.
+        inline int response::parse_range(const std::string& value, std::size_t total, std::size_t& first, std::size_t& last)
+        {
+            if(value.compare(0, 6, "bytes=") != 0 || value.find(',') != std::string::npos) return -1;
+
+            auto spec = value.c_str() + 6;
+            char* end = nullptr;
+            if(*spec == '-')
+            {
+                auto suffix = strtoull(spec + 1, &end, 10);
+                if(end == spec + 1 || *end) return -1;
+                if(!suffix || !total) return 0;
+
+                first = suffix < total ? total - static_cast<std::size_t>(suffix) : 0;
+                last = total - 1;
+                return 1;
+            }
+
+            if(*spec < '0' || *spec > '9') return -1;
+            auto a = strtoull(spec, &end, 10);
+            if(*end != '-') return -1;
+
+            auto b = ULLONG_MAX;
+            if(end[1])
+            {
+                auto p = end + 1;
+                b = strtoull(p, &end, 10);
+                if(end == p || *end || b < a) return -1;
+            }
+
+            if(a >= total) return 0;
+            first = static_cast<std::size_t>(a);
+            last = static_cast<std::size_t>(std::min<unsigned long long>(b, total - 1));
+            return 1;
+        }
+
+        inline void response::push(std::string&& piece)
+        {
+            if(piece.empty()) return;
+
+            output_bytes_ += piece.length();
+            output_.push_back(output_piece(std::move(piece)));
+        }
+
+        inline void response::push(const char* data, std::size_t len, std::shared_ptr<const void> owner)
+        {
+            if(!len) return;
+
+            output_bytes_ += len;
+            output_.push_back(output_piece(data, len, std::move(owner)));
+        }
+
+        // Writes the status line and the headers into a buffer recycled by the connection.
+        // content_length is emitted unless set by the user or npos. fields are serialized
+        // header lines that come first; the default Content-Type is then left out.
+        inline void response::serialize_head(std::size_t content_length, const std::string* fields)
+        {
+            auto it = headers_.find("Connection");
+            if(it != headers_.end() && native::text::ci_equal(it->second, "close")) keep_alive_ = false;
+
+            auto head = client_->acquire_buffer();
+            head.append(get_status_line(status_));
+            if(fields) head.append(*fields);
+            for(auto& h : headers_)
+            {
+                if(native::text::ci_equal(h.first, "Connection")) continue;
+                if(fields && !content_type_set_ && native::text::ci_equal(h.first, "Content-Type")) continue;
+                head.append(h.first).append(": ", 2).append(h.second).append("\r\n", 2);
+            }
+
+            if(content_length != std::string::npos && headers_.find("Content-Length") == headers_.end())
+            {
+                char value[24];
+                head.append("Content-Length: ", 16).append(value, snprintf(value, sizeof(value), "%zu", content_length)).append("\r\n", 2);
+            }
+            if(chunked_) head.append("Transfer-Encoding: chunked\r\n", 28);
+
+            if(!keep_alive_) head.append("Connection: close\r\n", 19);
+            else if(http_minor_ == 0) head.append("Connection: keep-alive\r\n", 24);
+            head.append("\r\n", 2);
+
+            push(std::move(head));
+        }
+
+        /*!
+         *  Cache of small static files for the responses of one loop. The contents, ETag, Last-Modified and
+         *  Content-Type of a file are kept in memory so that a hit is answered (with 304 to a matching
+         *  If-None-Match or If-Modified-Since) without any system call.
+         *  Each entry is watched with a uv_fs_event_t and dropped as soon as its file changes; entries are
+         *  evicted in LRU order to stay under max_bytes. Use one per loop (e.g. per cluster worker).
+         */
+        class file_cache
+        {
+        public:
+            static const std::size_t default_max_bytes = 64 * 1024 * 1024;
+            static const std::size_t default_max_file_size = 1024 * 1024;
+
+            struct counters
+            {
+                std::size_t hits;
+                std::size_t misses;
+                std::size_t not_modified; // 304 answers, counted as hits too
+                std::size_t evictions;
+                std::size_t invalidations;
+            };
+
+            file_cache(std::size_t max_bytes=default_max_bytes, std::size_t max_file_size=default_max_file_size)
+                : loop_(uv_default_loop())
+                , max_bytes_(max_bytes)
+                , max_file_size_(max_file_size)
+                , bytes_(0)
+                , entries_()
+                , lru_()
+                , counters_()
+            {
+            }
+
+            file_cache(native::loop& l, std::size_t max_bytes=default_max_bytes, std::size_t max_file_size=default_max_file_size)
+                : loop_(l.get())
+                , max_bytes_(max_bytes)
+                , max_file_size_(max_file_size)
+                , bytes_(0)
+                , entries_()
+                , lru_()
+                , counters_()
+            {
+            }
+
+            ~file_cache()
+            {
+                clear();
+            }
+
+        public:
+            /*!
+             *  Answers req with the file at path.
+             *  A miss is served with response::send_file() while the file is loaded into the cache for the
+             *  next requests. Range requests and files larger than max_file_size are always served from disk.
+             */
+            bool serve(request& req, response& res, const std::string& path)
+            {
+                auto it = entries_.find(path);
+                if(it == entries_.end() || !it->second->cached || !req.get_header("Range").empty())
+                {
+                    ++counters_.misses;
+                    if(it == entries_.end()) load(path);
+                    return res.send_file(path);
+                }
+
+                auto e = it->second;
+                ++counters_.hits;
+                lru_.splice(lru_.begin(), lru_, e->lru);
+
+                // the body is shared with the socket, the header fields are serialized once per entry
+                if(not_modified(req, e))
+                {
+                    ++counters_.not_modified;
+                    res.set_status(304);
+                    return res.end_serialized(e->fields, nullptr, 0, nullptr);
+                }
+                return res.end_serialized(e->fields, e->body->data(), e->body->size(), e->body);
+            }
+
+            /*!
+             *  Drops the entry of path, if any.
+             */
+            void invalidate(const std::string& path)
+            {
+                auto it = entries_.find(path);
+                if(it != entries_.end()) remove(it->second);
+            }
+
+            void clear()
+            {
+                while(!entries_.empty()) remove(entries_.begin()->second);
+            }
+
+            /*!
+             *  Bytes held by the cache.
+             */
+            std::size_t size() const { return bytes_; }
+            std::size_t count() const { return entries_.size(); }
+
+            const counters& get_counters() const { return counters_; }
+            void reset_counters() { counters_ = counters(); }
+
+        private:
+            struct entry
+            {
+                file_cache* cache; // nullptr once the entry is dropped while its file loads
+                uv_loop_t* loop;
+                std::string path;
+                std::shared_ptr<const std::string> body;
+                std::string etag;
+                std::string last_modified;
+                std::string fields; // Content-Type, ETag, Last-Modified and Content-Length lines
+                const char* content_type;
+                time_t mtime;
+                uv_fs_event_t* watcher;
+                std::list<entry*>::iterator lru;
+                std::size_t charge; // bytes accounted for in the cache
+                bool ready; // loaded, or found not cacheable (then served from disk)
+                bool cached; // body holds the file
+                bool stale; // changed while loading
+            };
+
+            file_cache(const file_cache&);
+            void operator =(const file_cache&);
+
+            static bool not_modified(const request& req, const entry* e)
+            {
+                // If-None-Match takes precedence over If-Modified-Since
+                auto& tags = req.get_header("If-None-Match");
+                if(!tags.empty()) return tags == "*" || tags.find(e->etag) != std::string::npos;
+
+                auto& since = req.get_header("If-Modified-Since");
+                if(since.empty()) return false;
+                if(since == e->last_modified) return true;
+
+                struct tm tm;
+                memset(&tm, 0, sizeof(tm));
+                if(!strptime(since.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm)) return false;
+                return timegm(&tm) >= e->mtime;
+            }
+
+            // The watcher is started before the file is read: a change during the load marks the entry stale.
+            void load(const std::string& path)
+            {
+                auto e = new entry;
+                e->cache = this;
+                e->loop = loop_;
+                e->path = path;
+                e->content_type = get_mime_type(path);
+                e->mtime = 0;
+                e->charge = 0;
+                e->ready = false;
+                e->cached = false;
+                e->stale = false;
+                e->watcher = new uv_fs_event_t;
+                if(uv_fs_event_init(loop_, e->watcher, path.c_str(), on_change, 0))
+                {
+                    // missing, or out of inotify watches: not cached
+                    delete e->watcher;
+                    delete e;
+                    return;
+                }
+                e->watcher->data = e;
+                entries_[path] = e;
+
+                if(!native::fs::internal::open(loop_, path, native::fs::read_only, 0, [e](native::fs::file_handle fd, error err) {
+                    if(err) loaded(e);
+                    else on_open(e, fd);
+                }))
+                {
+                    remove(e);
+                }
+            }
+
+            static void on_open(entry* e, native::fs::file_handle fd)
+            {
+                if(!native::fs::internal::fstat(e->loop, fd, [e, fd](const native::fs::stats& st, error err) {
+                    if(err || !e->cache || !st.is_file() || st.size > static_cast<int64_t>(e->cache->max_file_size_))
+                    {
+                        // not read: served from disk until it changes
+                        close_file(e->loop, fd);
+                        if(!err) e->ready = true;
+                        loaded(e);
+                        return;
+                    }
+
+                    char value[64];
+                    e->mtime = st.mtime;
+                    e->etag.assign(value, snprintf(value, sizeof(value), "\"%llx-%llx\"", static_cast<unsigned long long>(st.size), static_cast<unsigned long long>(st.mtime)));
+                    e->last_modified = format_http_date(st.mtime);
+                    if(!native::fs::internal::read_to_end(e->loop, fd, [e, fd](const std::string& str, error err) {
+                        close_file(e->loop, fd);
+                        if(!err)
+                        {
+                            char value[24];
+                            e->body = std::make_shared<std::string>(str);
+                            e->fields.append("Content-Type: ").append(e->content_type).append("\r\n");
+                            e->fields.append("ETag: ").append(e->etag).append("\r\n");
+                            e->fields.append("Last-Modified: ").append(e->last_modified).append("\r\n");
+                            e->fields.append("Content-Length: ").append(value, snprintf(value, sizeof(value), "%zu", str.length())).append("\r\n");
+                            e->ready = e->cached = true;
+                        }
+                        loaded(e);
+                    }, native::fs::default_read_chunk_size))
+                    {
+                        close_file(e->loop, fd);
+                        loaded(e);
+                    }
+                }))
+                {
+                    close_file(e->loop, fd);
+                    loaded(e);
+                }
+            }
+
+            static void close_file(uv_loop_t* loop, native::fs::file_handle fd)
+            {
+                native::fs::internal::close(loop, fd, [](error) {});
+            }
+
+            static void loaded(entry* e)
+            {
+                auto cache = e->cache;
+                if(!cache)
+                {
+                    // dropped meanwhile
+                    delete e;
+                    return;
+                }
+
+                // failed, or changed since: the next request loads it again.
+                if(!e->ready || e->stale)
+                {
+                    e->ready = true;
+                    cache->remove(e);
+                    return;
+                }
+                cache->insert(e);
+            }
+
+            void insert(entry* e)
+            {
+                e->charge = sizeof(entry) + e->path.size() + e->fields.size() + (e->body ? e->body->size() : 0);
+                if(e->charge > max_bytes_)
+                {
+                    e->cached = false;
+                    e->body = nullptr;
+                    e->charge = sizeof(entry) + e->path.size();
+                }
+
+                lru_.push_front(e);
+                e->lru = lru_.begin();
+                bytes_ += e->charge;
+                while(bytes_ > max_bytes_ && lru_.size() > 1)
+                {
+                    ++counters_.evictions;
+                    remove(lru_.back());
+                }
+            }
+
+            // An entry still loading is left for loaded() to delete.
+            void remove(entry* e)
+            {
+                entries_.erase(e->path);
+                if(e->watcher)
+                {
+                    e->watcher->data = nullptr;
+                    uv_close(reinterpret_cast<uv_handle_t*>(e->watcher), [](uv_handle_t* h) {
+                        delete reinterpret_cast<uv_fs_event_t*>(h);
+                    });
+                    e->watcher = nullptr;
+                }
+
+                if(!e->ready)
+                {
+                    e->cache = nullptr;
+                    return;
+                }
+
+                if(e->charge)
+                {
+                    lru_.erase(e->lru);
+                    bytes_ -= e->charge;
+                }
+                delete e;
+            }
+
+            static void on_change(uv_fs_event_t* handle, const char*, int, int)
+            {
+                auto e = reinterpret_cast<entry*>(handle->data);
+                if(!e) return;
+
+                if(!e->ready)
+                {
+                    e->stale = true;
+                    return;
+                }
+                ++e->cache->counters_.invalidations;
+                e->cache->remove(e);
+            }
+
+        private:
+            uv_loop_t* loop_;
+            std::size_t max_bytes_;
+            std::size_t max_file_size_;
+            std::size_t bytes_;
+            std::map<std::string, entry*> entries_;
+            std::list<entry*> lru_; // most recently used first
+            counters counters_;
+        };
+
+        /*!
+         *  Ignores SIGPIPE for the whole process, unless a handler is already installed.
+         *  Where SO_NOSIGPIPE exists (BSD, macOS) every connection already suppresses it. Elsewhere (Linux) a write
+         *  to a peer that closed its connection raises SIGPIPE, whose default action kills the process: servers
+         *  should call this once at startup, or handle SIGPIPE themselves. It is never done implicitly.
+         */
+        inline void ignore_sigpipe()
+        {
+            struct sigaction sa;
+            if(sigaction(SIGPIPE, nullptr, &sa) == 0 && sa.sa_handler == SIG_DFL) signal(SIGPIPE, SIG_IGN);
+        }
+
+        /*!
+         *  HTTP server.
+         *  Connections are closed when a timeout expires: by default 60 s to receive the headers of a request,
+         *  60 s between two reads of its body, 5 s idle between requests and 60 s without write progress.
+         *  Change or disable them (0) with set_timeouts(). On Linux, see ignore_sigpipe().
+         */
+        class http
+        {
+        public:
+            static const std::size_t default_max_body_size = 1024 * 1024;
+
+            http()
+                : socket_(new native::net::tcp)
+                , clients_()
+                , max_requests_(0)
+                , max_body_size_(default_max_body_size)
+                , timeouts_()
+            {
+            }
+
+            /*!
+             *  Server whose listener and connections run on the given loop.
+             */
+            http(native::loop& l)
+                : socket_(new native::net::tcp(l))
+                , clients_()
+                , max_requests_(0)
+                , max_body_size_(default_max_body_size)
+                , timeouts_()
+            {
+            }
+
+            virtual ~http()
+            {
+                if(socket_)
+                {
+                    socket_->close([](){});
+                }
+
+                // connections in progress keep going on their own
+                for(auto client : clients_) client->registry_ = nullptr;
+            }
+
+        public:
+            static std::shared_ptr<http> create_server(const std::string& ip, int port, std::function<void(request&, response&)> callback)
+            {
+                auto server = std::shared_ptr<http>(new http);
+                if(server->listen(ip, port, callback)) return server;
+                return nullptr;
+            }
+
+            bool listen(const std::string& ip, int port, std::function<void(request&, response&)> callback)
+            {
+                if(!socket_ || !socket_->bind(ip, port)) return false;
+                return start(callback);
+            }
+
+            /*!
+             *  Listens on an already bound socket, e.g. one of the listeners of a cluster.
+             */
+            bool listen(uv_os_sock_t sock, std::function<void(request&, response&)> callback)
+            {
+                if(!socket_ || !socket_->open(sock)) return false;
+                return start(callback);
+            }
+
+            /*!
+             *  Stops accepting connections. Requests in progress are answered,
+             *  then their connections are closed.
+             */
+            void close()
+            {
+                if(socket_)
+                {
+                    socket_->close([](){});
+                    socket_ = nullptr;
+                }
+
+                std::set<client_context*> clients;
+                clients.swap(clients_);
+                for(auto client : clients) client->shutdown();
+            }
+
+            /*!
+             *  Limits the number of requests served over one persistent connection.
+             *  The response to the last one carries "Connection: close". 0 means no limit.
+             */
+            void set_max_requests_per_connection(std::size_t max_requests)
+            {
+                max_requests_ = max_requests;
+            }
+
+            /*!
+             *  Buffers request bodies of up to max_body_size bytes (default_max_body_size by default): the handler is
+             *  then invoked once the whole request is received and request::get_body() is filled.
+             *  Larger bodies are answered with 413. 0 streams the body instead: the handler is invoked
+             *  after the headers and reads it via request::on_data().
+             */
+            void set_body_buffering(std::size_t max_body_size)
+            {
+                max_body_size_ = max_body_size;
+            }
+
+            /*!
+             *  Sets the header, body, keep-alive and write timeouts of new connections.
+             *  They are all driven by one timer wheel per loop, not by a libuv timer per connection.
+             */
+            void set_timeouts(const timeouts& t)
+            {
+                timeouts_ = t;
+            }
+
+        private:
+            bool start(std::function<void(request&, response&)> callback)
+            {
+                return socket_->listen([=](error e) {
+                    if(e)
+                    {
+                        // TODO: handle client connection error
+                    }
+                    else
+                    {
+                        auto client = new client_context(socket_.get(), &clients_, max_requests_, max_body_size_, timeouts_);
+                        client->parse(callback);
+                    }
+                });
+            }
+
+        private:
+            std::shared_ptr<native::net::tcp> socket_;
+            std::set<client_context*> clients_;
+            std::size_t max_requests_;
+            std::size_t max_body_size_;
+            timeouts timeouts_;
+        };
+
+        /*!
+         *  HTTP server running one event loop per worker thread.
+         *  Every worker listens on the port itself: with SO_REUSEPORT where the system supports it,
+         *  otherwise on a duplicate of one shared listening socket. Connections stay on the worker
+         *  that accepted them, and so do the per-loop pools they use. The handler runs on worker threads.
+         */
+        class cluster
+        {
+            struct worker
+            {
+                worker()
+                    : loop()
+                    , server()
+                    , thread()
+                    , stop_async()
+                {}
+
+                native::loop loop;
+                std::unique_ptr<http> server;
+                std::thread thread;
+                uv_async_t stop_async;
+            };
+
+        public:
+            /*!
+             *  @param num_workers number of worker threads/loops; 0 means one per hardware thread.
+             */
+            cluster(std::size_t num_workers=0)
+                : workers_()
+                , num_workers_(num_workers)
+                , max_requests_(0)
+                , max_body_size_(http::default_max_body_size)
+                , timeouts_()
+            {
+                if(!num_workers_) num_workers_ = std::max(1u, std::thread::hardware_concurrency());
+            }
+
+            virtual ~cluster()
+            {
+                stop();
+            }
+
+        public:
+            /*!
+             *  Binds the workers' listeners to ip:port and starts the worker threads.
+             */
+            bool listen(const std::string& ip, int port, std::function<void(request&, response&)> callback)
+            {
+                if(!workers_.empty()) return false;
+
+                std::vector<uv_os_sock_t> socks;
+                bool reuse_port = true;
+                auto sock = open_listener(ip, port, true);
+                if(sock < 0)
+                {
+                    reuse_port = false;
+                    sock = open_listener(ip, port, false);
+                }
+
+                while(sock >= 0)
+                {
+                    socks.push_back(sock);
+                    if(socks.size() == num_workers_) break;
+                    sock = reuse_port ? open_listener(ip, port, true) : ::dup(socks.front());
+                }
+
+                if(socks.size() < num_workers_)
+                {
+                    for(auto s : socks) ::close(s);
+                    return false;
+                }
+
+                // set up every loop before any of them runs.
+                bool ok = true;
+                for(auto s : socks)
+                {
+                    std::unique_ptr<worker> w(new worker);
+                    w->server.reset(new http(w->loop));
+                    w->server->set_max_requests_per_connection(max_requests_);
+                    w->server->set_body_buffering(max_body_size_);
+                    w->server->set_timeouts(timeouts_);
+
+                    uv_async_init(w->loop.get(), &w->stop_async, [](uv_async_t* a, int) {
+                        auto w = reinterpret_cast<worker*>(a->data);
+                        w->server->close();
+                        uv_close(reinterpret_cast<uv_handle_t*>(a), nullptr);
+                    });
+                    w->stop_async.data = w.get();
+
+                    if(ok) ok = w->server->listen(s, callback);
+                    else ::close(s);
+
+                    workers_.push_back(std::move(w));
+                }
+
+                if(!ok)
+                {
+                    stop();
+                    return false;
+                }
+
+                for(auto& w : workers_)
+                {
+                    auto loop = &w->loop;
+                    w->thread = std::thread([loop]() { loop->run(); });
+                }
+                return true;
+            }
+
+            /*!
+             *  Stops accepting connections, lets the workers finish the requests in progress
+             *  and waits for their threads to exit.
+             */
+            void stop()
+            {
+                for(auto& w : workers_)
+                {
+                    if(w->thread.joinable()) uv_async_send(&w->stop_async);
+                    else
+                    {
+                        // never started: shut down on this thread.
+                        w->server->close();
+                        uv_close(reinterpret_cast<uv_handle_t*>(&w->stop_async), nullptr);
+                        w->loop.run();
+                    }
+                }
+
+                for(auto& w : workers_)
+                {
+                    if(w->thread.joinable()) w->thread.join();
+                }
+                workers_.clear();
+            }
+
+            std::size_t num_workers() const { return num_workers_; }
+
+            /*!
+             *  Same as http::set_max_requests_per_connection(), for every worker. Set before listen().
+             */
+            void set_max_requests_per_connection(std::size_t max_requests)
+            {
+                max_requests_ = max_requests;
+            }
+
+            /*!
+             *  Same as http::set_body_buffering(), for every worker. Set before listen().
+             */
+            void set_body_buffering(std::size_t max_body_size)
+            {
+                max_body_size_ = max_body_size;
+            }
+
+            /*!
+             *  Same as http::set_timeouts(), for every worker. Set before listen().
+             */
+            void set_timeouts(const timeouts& t)
+            {
+                timeouts_ = t;
+            }
+
+        private:
+            // non-blocking socket bound to ip:port, or -1
+            static uv_os_sock_t open_listener(const std::string& ip, int port, bool reuse_port)
+            {
+                auto addr = uv_ip4_addr(ip.c_str(), port);
+                int sock = ::socket(AF_INET, SOCK_STREAM, 0);
+                if(sock < 0) return -1;
+
+                int on = 1;
+                bool ok = ::setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == 0;
+                if(ok && reuse_port)
+                {
+#ifdef SO_REUSEPORT
+                    ok = ::setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == 0;
+#else
+                    ok = false;
+#endif
+                }
+                if(ok) ok = ::fcntl(sock, F_SETFL, ::fcntl(sock, F_GETFL) | O_NONBLOCK) == 0;
+                if(ok) ok = ::fcntl(sock, F_SETFD, FD_CLOEXEC) == 0;
+                if(ok) ok = ::bind(sock, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) == 0;
+
+                if(!ok)
+                {
+                    ::close(sock);
+                    return -1;
+                }
+                return sock;
+            }
+
+        private:
+            cluster(const cluster&);
+            void operator =(const cluster&);
+
+        private:
+            std::vector<std::unique_ptr<worker>> workers_;
+            std::size_t num_workers_;
+            std::size_t max_requests_;
+            std::size_t max_body_size_;
+            timeouts timeouts_;
         };
 
         typedef http_method method;
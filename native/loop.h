@@ -3,9 +3,257 @@
 
 #include "base.h"
 #include "error.h"
+#include <atomic>
+#include <thread>
 
 namespace native
 {
+    namespace internal
+    {
+        /*!
+         *  Objects that live as long as a loop (request pools, buffer pools, ...).
+         *  They hang off uv_loop_t::data and are only used from the loop's thread.
+         *  On teardown, every object with a shutdown() member is shut down first, while all of them still exist:
+         *  that is where completions still in flight must be delivered and handles closed.
+         */
+        class loop_data
+        {
+            struct entry_base
+            {
+                virtual ~entry_base() {}
+                virtual void shutdown() = 0;
+            };
+
+            template<typename T>
+            struct entry : public entry_base
+            {
+                T value;
+
+                virtual void shutdown() { shutdown_value(value, 0); }
+            };
+
+            template<typename T>
+            static auto shutdown_value(T& x, int) -> decltype(x.shutdown()) { return x.shutdown(); }
+
+            template<typename T>
+            static void shutdown_value(T&, long) {}
+
+            template<typename T>
+            struct key
+            {
+                static char id;
+            };
+
+        public:
+            loop_data()
+                : entries_()
+            {}
+
+            ~loop_data()
+            {
+                shutdown();
+
+                // an entry is removed before it is deleted: get() never returns a deleted object.
+                while(!entries_.empty())
+                {
+                    auto e = entries_.back().second;
+                    entries_.pop_back();
+                    delete e;
+                }
+            }
+
+            // in creation order; objects created meanwhile are shut down too.
+            void shutdown()
+            {
+                for(std::size_t i = 0; i < entries_.size(); ++i) entries_[i].second->shutdown();
+            }
+
+            template<typename T>
+            T& get()
+            {
+                const void* k = &key<T>::id;
+                for(auto& e : entries_)
+                {
+                    if(e.first == k) return static_cast<entry<T>*>(e.second)->value;
+                }
+
+                auto x = new entry<T>;
+                entries_.push_back(std::make_pair(k, x));
+                return x->value;
+            }
+
+        private:
+            loop_data(const loop_data&);
+            void operator =(const loop_data&);
+
+        private:
+            std::vector<std::pair<const void*, entry_base*>> entries_;
+        };
+
+        template<typename T>
+        char loop_data::key<T>::id = 0;
+
+        /*!
+         *  Returns the instance of T that belongs to the loop, creating it on first use.
+         */
+        template<typename T>
+        T& loop_local(uv_loop_t* l)
+        {
+            if(!l->data) l->data = new loop_data;
+            return reinterpret_cast<loop_data*>(l->data)->get<T>();
+        }
+
+        // first step of a loop's teardown, see loop_data.
+        inline void shutdown_loop_data(uv_loop_t* l)
+        {
+            if(l->data) reinterpret_cast<loop_data*>(l->data)->shutdown();
+        }
+
+        inline void delete_loop_data(uv_loop_t* l)
+        {
+            delete reinterpret_cast<loop_data*>(l->data);
+            l->data = nullptr;
+        }
+
+        /*!
+         *  Tasks posted to a loop from any thread: a lock-free intrusive MPSC queue, drained on the loop's thread.
+         *  Wakeups are coalesced: only a post that finds the queue unsignaled calls uv_async_send().
+         */
+        class post_queue
+        {
+        public:
+            // tasks run per loop iteration: the rest wait for the next one, so I/O is not starved.
+            static const std::size_t max_batch = 1024;
+
+            post_queue(uv_loop_t* loop)
+                : head_(&stub_)
+                , tail_(&stub_)
+                , stub_()
+                , signaled_(false)
+                , producers_(0)
+                , closed_(false)
+                , async_(new uv_async_t)
+            {
+                stub_.next.store(nullptr, std::memory_order_relaxed);
+                uv_async_init(loop, async_, on_async);
+                async_->data = this;
+                uv_unref(reinterpret_cast<uv_handle_t*>(async_));
+            }
+
+            ~post_queue()
+            {
+                close();
+                while(auto n = pop()) delete n;
+            }
+
+        public:
+            void push(std::function<void()> task)
+            {
+                auto n = new node;
+                n->task = std::move(task);
+
+                ++producers_;
+                push(n);
+                if(!closed_.load() && !signaled_.exchange(true)) uv_async_send(async_);
+                --producers_;
+            }
+
+            /*!
+             *  Closes the async handle (loop thread only): tasks posted afterwards never run.
+             *  Its close callback runs on the next loop iteration.
+             */
+            void close()
+            {
+                if(closed_.exchange(true)) return;
+
+                // a producer may still be signaling after its task already ran
+                while(producers_.load()) std::this_thread::yield();
+
+                uv_close(reinterpret_cast<uv_handle_t*>(async_), [](uv_handle_t* h) { delete reinterpret_cast<uv_async_t*>(h); });
+                async_ = nullptr;
+            }
+
+            /*!
+             *  Keeps the loop alive while tasks are expected, e.g. results of work in flight. Loop thread only.
+             */
+            void ref() { if(async_) uv_ref(reinterpret_cast<uv_handle_t*>(async_)); }
+            void unref() { if(async_) uv_unref(reinterpret_cast<uv_handle_t*>(async_)); }
+
+        private:
+            post_queue(const post_queue&);
+            void operator =(const post_queue&);
+
+            struct node
+            {
+                std::atomic<node*> next;
+                std::function<void()> task;
+            };
+
+            void push(node* n)
+            {
+                n->next.store(nullptr, std::memory_order_relaxed);
+                auto prev = head_.exchange(n, std::memory_order_acq_rel);
+                prev->next.store(n, std::memory_order_release);
+            }
+
+            // consumer side: nullptr if empty, or if the next push is not linked yet (its post signals again).
+            node* pop()
+            {
+                auto tail = tail_;
+                auto next = tail->next.load(std::memory_order_acquire);
+                if(tail == &stub_)
+                {
+                    if(!next) return nullptr;
+                    tail_ = tail = next;
+                    next = next->next.load(std::memory_order_acquire);
+                }
+
+                if(next)
+                {
+                    tail_ = next;
+                    return tail;
+                }
+
+                if(tail != head_.load(std::memory_order_acquire)) return nullptr;
+
+                // tail is the last node: put the stub behind it to take it out
+                push(&stub_);
+                next = tail->next.load(std::memory_order_acquire);
+                if(next)
+                {
+                    tail_ = next;
+                    return tail;
+                }
+                return nullptr;
+            }
+
+            static void on_async(uv_async_t* a, int)
+            {
+                auto q = reinterpret_cast<post_queue*>(a->data);
+                q->signaled_.store(false);
+
+                for(std::size_t i = 0; i < max_batch; ++i)
+                {
+                    std::unique_ptr<node> n(q->pop());
+                    if(!n) return;
+                    n->task();
+                }
+
+                // more left: continue on the next iteration
+                if(!q->signaled_.exchange(true)) uv_async_send(q->async_);
+            }
+
+        private:
+            std::atomic<node*> head_; // producers
+            node* tail_; // consumer
+            node stub_;
+            std::atomic<bool> signaled_;
+            std::atomic<int> producers_; // inside push()
+            std::atomic<bool> closed_;
+            uv_async_t* async_;
+        };
+    }
+
     /*!
      *  Class that represents the loop instance.
      */
@@ -18,6 +266,7 @@ namespace native
          */
         loop(bool use_default=false)
             : uv_loop_(use_default ? uv_default_loop() : uv_loop_new())
+            , posts_(new internal::post_queue(uv_loop_))
         { }
 
         /*!
@@ -27,6 +276,16 @@ namespace native
         {
             if(uv_loop_)
             {
+                // loop-local objects deliver what is still in flight and close their handles first:
+                // their callbacks may still post() and use any loop-local object.
+                internal::shutdown_loop_data(uv_loop_);
+                posts_->close();
+
+                // runs the close callbacks of those handles, while everything they may touch still exists
+                uv_run(uv_loop_, UV_RUN_NOWAIT);
+
+                internal::delete_loop_data(uv_loop_);
+                posts_.reset();
                 uv_loop_delete(uv_loop_);
                 uv_loop_ = nullptr;
             }
@@ -75,12 +334,20 @@ namespace native
          */
         error last_error() { return uv_last_error(uv_loop_); }
 
+        /*!
+         *  Runs task on the loop's thread. Safe to call from any thread while the loop object exists.
+         *  Tasks run in the order they were posted, at most post_queue::max_batch per loop iteration.
+         *  A pending task does not keep the loop alive: it runs while (or once) the loop is running.
+         */
+        void post(std::function<void()> task) { posts_->push(std::move(task)); }
+
     private:
         loop(const loop&);
         void operator =(const loop&);
 
     private:
         uv_loop_t* uv_loop_;
+        std::unique_ptr<internal::post_queue> posts_;
     };
 
     /*!
@@ -6,8 +6,12 @@
 #include "loop.h"
 #include "error.h"
 #include "tcp.h"
+#include "udp.h"
+#include "pipe.h"
+#include "timer.h"
 #include "http.h"
 #include "fs.h"
+#include "work.h"
 
 /*!
  *  @mainpage Documentation
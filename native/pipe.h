@@ -0,0 +1,68 @@
+#ifndef __PIPE_H__
+#define __PIPE_H__
+
+#include "base.h"
+#include "handle.h"
+#include "stream.h"
+#include "callback.h"
+
+namespace native
+{
+    namespace net
+    {
+        /*!
+         *  Unix domain socket (named pipe on Windows).
+         *  An IPC pipe (ipc=true) can also pass handles between processes, see stream::write2() and stream::read2_start().
+         */
+        class pipe : public native::base::stream
+        {
+        public:
+            template<typename X>
+            pipe(X* x)
+                : stream(x)
+            { }
+
+        public:
+            pipe(bool ipc=false)
+                : native::base::stream(native::internal::alloc_handle<uv_pipe_t>())
+            {
+                uv_pipe_init(uv_default_loop(), get<uv_pipe_t>(), ipc?1:0);
+            }
+
+            pipe(native::loop& l, bool ipc=false)
+                : native::base::stream(native::internal::alloc_handle<uv_pipe_t>())
+            {
+                uv_pipe_init(l.get(), get<uv_pipe_t>(), ipc?1:0);
+            }
+
+            static std::shared_ptr<pipe> create(bool ipc=false)
+            {
+                return std::shared_ptr<pipe>(new pipe(ipc));
+            }
+
+            bool bind(const std::string& name) { return uv_pipe_bind(get<uv_pipe_t>(), name.c_str()) == 0; }
+
+            /*!
+             *  Wraps an existing file descriptor, e.g. one end of a socketpair() shared with a child process.
+             */
+            bool open(uv_file fd) { return uv_pipe_open(get<uv_pipe_t>(), fd) == 0; }
+
+            /*!
+             *  Connects to the socket bound to name; errors are reported to the callback only.
+             */
+            bool connect(const std::string& name, std::function<void(error)> callback)
+            {
+                callbacks::store(get()->data, native::internal::uv_cid_connect, std::move(callback));
+                uv_pipe_connect(new uv_connect_t, get<uv_pipe_t>(), name.c_str(), [](uv_connect_t* req, int status) {
+                    callbacks::invoke<decltype(callback)>(req->handle->data, native::internal::uv_cid_connect, status?uv_last_error(req->handle->loop):error());
+                    delete req;
+                });
+                return true;
+            }
+
+            bool is_ipc() const { return get<uv_pipe_t>()->ipc != 0; }
+        };
+    }
+}
+
+#endif
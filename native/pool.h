@@ -0,0 +1,121 @@
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include "base.h"
+
+namespace native
+{
+    namespace internal
+    {
+        /*!
+         *  Free list of objects: released objects are handed out again instead of being
+         *  deleted, up to max_free of them. Not thread-safe: keep one per loop.
+         */
+        template<typename T, std::size_t max_free=256>
+        class object_pool
+        {
+        public:
+            object_pool()
+                : free_()
+            {}
+
+            ~object_pool()
+            {
+                for(auto x : free_) delete x;
+            }
+
+            T* acquire()
+            {
+                if(free_.empty()) return new T;
+
+                auto x = free_.back();
+                free_.pop_back();
+                return x;
+            }
+
+            void release(T* x)
+            {
+                if(free_.size() < max_free) free_.push_back(x);
+                else delete x;
+            }
+
+        private:
+            object_pool(const object_pool&);
+            void operator =(const object_pool&);
+
+        private:
+            std::vector<T*> free_;
+        };
+
+        /*!
+         *  Free list of fixed-size byte buffers (read buffers of the loop's streams).
+         *  Buffers of any other size are simply allocated and deleted.
+         */
+        class buffer_pool
+        {
+        public:
+            static const std::size_t default_buffer_size = 64 * 1024;
+            static const std::size_t default_max_free = 64;
+
+            buffer_pool()
+                : buffer_size_(default_buffer_size)
+                , max_free_(default_max_free)
+                , free_()
+            {}
+
+            ~buffer_pool()
+            {
+                clear();
+            }
+
+            void configure(std::size_t buffer_size, std::size_t max_free)
+            {
+                if(buffer_size != buffer_size_) clear();
+                buffer_size_ = buffer_size;
+                max_free_ = max_free;
+                while(free_.size() > max_free_)
+                {
+                    delete[] free_.back();
+                    free_.pop_back();
+                }
+            }
+
+            std::size_t buffer_size() const { return buffer_size_; }
+
+            char* acquire(std::size_t size)
+            {
+                if(size != buffer_size_ || free_.empty()) return new char[size];
+
+                auto buf = free_.back();
+                free_.pop_back();
+                return buf;
+            }
+
+            void release(char* buf, std::size_t size)
+            {
+                if(!buf) return;
+
+                if(size == buffer_size_ && free_.size() < max_free_) free_.push_back(buf);
+                else delete[] buf;
+            }
+
+        private:
+            void clear()
+            {
+                for(auto buf : free_) delete[] buf;
+                free_.clear();
+            }
+
+        private:
+            buffer_pool(const buffer_pool&);
+            void operator =(const buffer_pool&);
+
+        private:
+            std::size_t buffer_size_;
+            std::size_t max_free_;
+            std::vector<char*> free_;
+        };
+    }
+}
+
+#endif
@@ -5,11 +5,144 @@
 #include "error.h"
 #include "handle.h"
 #include "callback.h"
+#include "loop.h"
+#include "pool.h"
 
 #include <algorithm>
+#include <cstring>
+#include <initializer_list>
 
 namespace native
 {
+    namespace internal
+    {
+        // uv_write_t with its own callback and the buffers it owns until completion.
+        struct write_req
+        {
+            uv_write_t req;
+            std::function<void(native::error)> callback;
+            std::vector<std::string> bufs;
+            std::shared_ptr<const void> owner; // keeps borrowed memory alive, see stream::write()
+        };
+
+        typedef object_pool<write_req> write_req_pool;
+    }
+
+    /*!
+     *  Read buffer handed over to the consumer by stream::read_start_owned().
+     *  The memory goes back to the read buffer pool of its loop on release() or destruction,
+     *  which must happen on the loop's thread.
+     */
+    class read_buffer
+    {
+    public:
+        read_buffer()
+            : pool_(nullptr)
+            , base_(nullptr)
+            , capacity_(0)
+            , size_(0)
+        {}
+
+        read_buffer(native::internal::buffer_pool* pool, char* base, std::size_t capacity, std::size_t size)
+            : pool_(pool)
+            , base_(base)
+            , capacity_(capacity)
+            , size_(size)
+        {}
+
+        read_buffer(read_buffer&& x)
+            : pool_(x.pool_)
+            , base_(x.base_)
+            , capacity_(x.capacity_)
+            , size_(x.size_)
+        {
+            x.pool_ = nullptr;
+            x.base_ = nullptr;
+            x.capacity_ = x.size_ = 0;
+        }
+
+        read_buffer& operator =(read_buffer&& x)
+        {
+            if(this != &x)
+            {
+                release();
+                std::swap(pool_, x.pool_);
+                std::swap(base_, x.base_);
+                std::swap(capacity_, x.capacity_);
+                std::swap(size_, x.size_);
+            }
+            return *this;
+        }
+
+        ~read_buffer()
+        {
+            release();
+        }
+
+    public:
+        const char* data() const { return base_; }
+        std::size_t size() const { return size_; }
+        bool empty() const { return size_ == 0; }
+
+        void release()
+        {
+            if(pool_) pool_->release(base_, capacity_);
+            else delete[] base_;
+
+            pool_ = nullptr;
+            base_ = nullptr;
+            capacity_ = size_ = 0;
+        }
+
+    private:
+        read_buffer(const read_buffer&);
+        void operator =(const read_buffer&);
+
+    private:
+        native::internal::buffer_pool* pool_;
+        char* base_;
+        std::size_t capacity_;
+        std::size_t size_;
+    };
+
+    /*!
+     *  Borrowed piece of memory for stream::write(): it is not copied.
+     */
+    struct buffer_ref
+    {
+        buffer_ref(const char* d, std::size_t n)
+            : data(d)
+            , size(n)
+        {}
+
+        buffer_ref(const char* s)
+            : data(s)
+            , size(std::strlen(s))
+        {}
+
+        buffer_ref(const std::string& s)
+            : data(s.data())
+            , size(s.length())
+        {}
+
+        const char* data;
+        std::size_t size;
+    };
+
+    /*!
+     *  Sets the size of the read buffers pooled for the streams of the default loop,
+     *  and how many free buffers the pool keeps.
+     */
+    inline void set_read_buffer_pool(std::size_t buffer_size, std::size_t max_free)
+    {
+        native::internal::loop_local<native::internal::buffer_pool>(uv_default_loop()).configure(buffer_size, max_free);
+    }
+
+    inline void set_read_buffer_pool(native::loop& l, std::size_t buffer_size, std::size_t max_free)
+    {
+        native::internal::loop_local<native::internal::buffer_pool>(l.get()).configure(buffer_size, max_free);
+    }
+
     namespace base
     {
         class stream : public handle
@@ -22,7 +155,7 @@ namespace native
 
             bool listen(std::function<void(native::error)> callback, int backlog=128)
             {
-                callbacks::store(get()->data, native::internal::uv_cid_listen, callback);
+                callbacks::store(get()->data, native::internal::uv_cid_listen, std::move(callback));
                 return uv_listen(get<uv_stream_t>(), backlog, [](uv_stream_t* s, int status) {
                     callbacks::invoke<decltype(callback)>(s->data, native::internal::uv_cid_listen, status?uv_last_error(s->loop):error());
                 }) == 0;
@@ -38,27 +171,54 @@ namespace native
                 return read_start<0>(callback);
             }
 
+            /*!
+             *  Starts reading into buffers taken from the loop's read buffer pool.
+             *  The buffer goes back to the pool when the callback returns;
+             *  reads ask for at least max_alloc_size bytes (larger buffers are not pooled).
+             *  len < 0 means EOF or a read error (e.g. a reset connection), see loop::last_error().
+             */
             template<size_t max_alloc_size>
             bool read_start(std::function<void(const char* buf, ssize_t len)> callback)
             {
-                callbacks::store(get()->data, native::internal::uv_cid_read_start, callback);
+                callbacks::store(get()->data, native::internal::uv_cid_read_start, std::move(callback));
 
                 return uv_read_start(get<uv_stream_t>(),
-                    [](uv_handle_t*, size_t suggested_size){
-                        auto size = std::max(suggested_size, max_alloc_size);
-                        return uv_buf_t { new char[size], size };
-                    },
+                    alloc_read_buffer<max_alloc_size>,
                     [](uv_stream_t* s, ssize_t nread, uv_buf_t buf){
                         if(nread < 0)
                         {
-                            assert(uv_last_error(s->loop).code == UV_EOF);
                             callbacks::invoke<decltype(callback)>(s->data, native::internal::uv_cid_read_start, nullptr, nread);
                         }
                         else if(nread >= 0)
                         {
                             callbacks::invoke<decltype(callback)>(s->data, native::internal::uv_cid_read_start, buf.base, nread);
                         }
-                        delete buf.base;
+                        native::internal::loop_local<native::internal::buffer_pool>(s->loop).release(buf.base, buf.len);
+                    }) == 0;
+            }
+
+            /*!
+             *  Starts reading, handing every filled buffer over to the callback without a copy.
+             *  The consumer keeps the read_buffer for as long as it needs the data; len < 0 means EOF or error.
+             */
+            bool read_start_owned(std::function<void(read_buffer buf, ssize_t len)> callback)
+            {
+                callbacks::store(get()->data, native::internal::uv_cid_read_start, std::move(callback));
+
+                return uv_read_start(get<uv_stream_t>(),
+                    alloc_read_buffer<0>,
+                    [](uv_stream_t* s, ssize_t nread, uv_buf_t buf){
+                        auto& pool = native::internal::loop_local<native::internal::buffer_pool>(s->loop);
+                        if(nread < 0)
+                        {
+                            pool.release(buf.base, buf.len);
+                            callbacks::invoke<decltype(callback)>(s->data, native::internal::uv_cid_read_start, read_buffer(), nread);
+                        }
+                        else
+                        {
+                            callbacks::invoke<decltype(callback)>(s->data, native::internal::uv_cid_read_start,
+                                read_buffer(&pool, buf.base, buf.len, static_cast<std::size_t>(nread)), nread);
+                        }
                     }) == 0;
             }
 
@@ -67,48 +227,194 @@ namespace native
                 return uv_read_stop(get<uv_stream_t>()) == 0;
             }
 
-            // TODO: implement read2_start()
+            /*!
+             *  Starts reading from an IPC pipe, which can also carry handles sent with write2().
+             *  If pending is not UV_UNKNOWN_HANDLE, a handle of that type arrived with the data:
+             *  accept() it into a new stream (e.g. a net::tcp) before the callback returns.
+             */
+            bool read2_start(std::function<void(const char* buf, ssize_t len, uv_handle_type pending)> callback)
+            {
+                callbacks::store(get()->data, native::internal::uv_cid_read_start, std::move(callback));
+
+                return uv_read2_start(get<uv_stream_t>(),
+                    alloc_read_buffer<0>,
+                    [](uv_pipe_t* p, ssize_t nread, uv_buf_t buf, uv_handle_type pending){
+                        callbacks::invoke<decltype(callback)>(p->data, native::internal::uv_cid_read_start, nread < 0 ? nullptr : buf.base, nread, pending);
+                        native::internal::loop_local<native::internal::buffer_pool>(p->loop).release(buf.base, buf.len);
+                    }) == 0;
+            }
 
+            /*!
+             *  Writes len bytes from buf, which must stay valid until the callback is invoked.
+             */
             bool write(const char* buf, int len, std::function<void(error)> callback)
             {
+                auto req = acquire_write_req();
                 uv_buf_t bufs[] = { uv_buf_t { const_cast<char*>(buf), static_cast<size_t>(len) } };
-                callbacks::store(get()->data, native::internal::uv_cid_write, callback);
-                return uv_write(new uv_write_t, get<uv_stream_t>(), bufs, 1, [](uv_write_t* req, int status) {
-                    callbacks::invoke<decltype(callback)>(req->handle->data, native::internal::uv_cid_write, status?uv_last_error(req->handle->loop):error());
-                    delete req;
-                }) == 0;
+                return submit_write(req, bufs, 1, callback);
             }
 
+            /*!
+             *  Writes len bytes from buf without a copy. owner (e.g. a fs::mapped_file holding buf)
+             *  is kept alive until the callback is invoked.
+             */
+            bool write(const char* buf, std::size_t len, std::shared_ptr<const void> owner, std::function<void(error)> callback)
+            {
+                auto req = acquire_write_req();
+                req->owner = std::move(owner);
+                uv_buf_t bufs[] = { uv_buf_t { const_cast<char*>(buf), len } };
+                return submit_write(req, bufs, 1, callback);
+            }
+
+            /*!
+             *  Writes a copy of buf: the caller does not need to keep it alive.
+             */
             bool write(const std::string& buf, std::function<void(error)> callback)
             {
-                uv_buf_t bufs[] = { uv_buf_t { const_cast<char*>(buf.c_str()), buf.length()} };
-                callbacks::store(get()->data, native::internal::uv_cid_write, callback);
-                return uv_write(new uv_write_t, get<uv_stream_t>(), bufs, 1, [](uv_write_t* req, int status) {
-                    callbacks::invoke<decltype(callback)>(req->handle->data, native::internal::uv_cid_write, status?uv_last_error(req->handle->loop):error());
-                    delete req;
-                }) == 0;
+                auto req = acquire_write_req(1);
+                req->bufs[0].assign(buf);
+                uv_buf_t bufs[] = { uv_buf_t { const_cast<char*>(req->bufs[0].data()), req->bufs[0].length() } };
+                return submit_write(req, bufs, 1, callback);
+            }
+
+            /*!
+             *  Writes buf without copying: it is owned by the request until completion.
+             */
+            bool write(std::string&& buf, std::function<void(error)> callback)
+            {
+                auto req = acquire_write_req(1);
+                req->bufs[0] = std::move(buf);
+                uv_buf_t bufs[] = { uv_buf_t { const_cast<char*>(req->bufs[0].data()), req->bufs[0].length() } };
+                return submit_write(req, bufs, 1, callback);
             }
 
+            /*!
+             *  Writes a copy of buf: the caller does not need to keep it alive.
+             */
             bool write(const std::vector<char>& buf, std::function<void(error)> callback)
             {
-                uv_buf_t bufs[] = { uv_buf_t { const_cast<char*>(&buf[0]), buf.size() } };
-                callbacks::store(get()->data, native::internal::uv_cid_write, callback);
-                return uv_write(new uv_write_t, get<uv_stream_t>(), bufs, 1, [](uv_write_t* req, int status) {
-                    callbacks::invoke<decltype(callback)>(req->handle->data, native::internal::uv_cid_write, status?uv_last_error(req->handle->loop):error());
-                    delete req;
-                }) == 0;
+                auto req = acquire_write_req(1);
+                req->bufs[0].assign(buf.begin(), buf.end());
+                uv_buf_t bufs[] = { uv_buf_t { const_cast<char*>(req->bufs[0].data()), req->bufs[0].length() } };
+                return submit_write(req, bufs, 1, callback);
+            }
+
+            /*!
+             *  Gather write: all buffers go out with a single uv_write() call, e.g. header + payload + trailer,
+             *  without copies. They must stay valid until the callback is invoked; owner (may be null) is kept alive until then.
+             *
+             *      s.write({ header, native::buffer_ref(body->data(), body->size()), "\r\n" }, body, callback);
+             */
+            bool write(std::initializer_list<buffer_ref> bufs, std::shared_ptr<const void> owner, std::function<void(error)> callback)
+            {
+                return write(bufs.begin(), bufs.size(), std::move(owner), std::move(callback));
+            }
+
+            bool write(std::initializer_list<buffer_ref> bufs, std::function<void(error)> callback)
+            {
+                return write(bufs.begin(), bufs.size(), nullptr, std::move(callback));
             }
 
-            // TODO: implement write2()
+            bool write(const buffer_ref* bufs, std::size_t nbufs, std::shared_ptr<const void> owner, std::function<void(error)> callback)
+            {
+                auto req = acquire_write_req();
+                req->owner = std::move(owner);
+
+                const std::size_t max_stack_bufs = 16;
+                uv_buf_t stack_bufs[max_stack_bufs];
+                std::vector<uv_buf_t> heap_bufs;
+                auto uv_bufs = stack_bufs;
+                if(nbufs > max_stack_bufs)
+                {
+                    heap_bufs.resize(nbufs);
+                    uv_bufs = &heap_bufs[0];
+                }
+                for(std::size_t i = 0; i < nbufs; ++i)
+                {
+                    uv_bufs[i] = uv_buf_t { const_cast<char*>(bufs[i].data), bufs[i].size };
+                }
+
+                return submit_write(req, uv_bufs, static_cast<int>(nbufs), callback);
+            }
+
+            /*!
+             *  Writes a copy of buf together with send_handle (e.g. an accepted net::tcp) over an IPC pipe.
+             *  buf must not be empty. The receiver gets the handle through read2_start(); close the local one once the callback is invoked.
+             */
+            bool write2(const std::string& buf, stream* send_handle, std::function<void(error)> callback)
+            {
+                auto req = acquire_write_req(1);
+                req->bufs[0].assign(buf);
+                uv_buf_t bufs[] = { uv_buf_t { const_cast<char*>(req->bufs[0].data()), req->bufs[0].length() } };
+                return submit_write(req, bufs, 1, callback, send_handle);
+            }
 
             bool shutdown(std::function<void(error)> callback)
             {
-                callbacks::store(get()->data, native::internal::uv_cid_shutdown, callback);
+                callbacks::store(get()->data, native::internal::uv_cid_shutdown, std::move(callback));
                 return uv_shutdown(new uv_shutdown_t, get<uv_stream_t>(), [](uv_shutdown_t* req, int status) {
                     callbacks::invoke<decltype(callback)>(req->handle->data, native::internal::uv_cid_shutdown, status?uv_last_error(req->handle->loop):error());
                     delete req;
                 }) == 0;
             }
+
+        private:
+            // read buffers come from a per-loop pool, see native::set_read_buffer_pool().
+            template<size_t min_size>
+            static uv_buf_t alloc_read_buffer(uv_handle_t* h, size_t)
+            {
+                auto& pool = native::internal::loop_local<native::internal::buffer_pool>(h->loop);
+                auto size = std::max(pool.buffer_size(), min_size);
+                return uv_buf_init(pool.acquire(size), size);
+            }
+
+            // write requests come from a per-loop pool: every write has its own callback
+            // and buffers, so any number of writes can be in flight on one stream.
+            native::internal::write_req* acquire_write_req(std::size_t nbufs=0)
+            {
+                auto req = native::internal::loop_local<native::internal::write_req_pool>(get()->loop).acquire();
+                req->req.data = req;
+                if(req->bufs.size() < nbufs) req->bufs.resize(nbufs);
+                return req;
+            }
+
+            static void release_write_req(uv_loop_t* loop, native::internal::write_req* req)
+            {
+                // keep small buffers' capacity for the next write: the pool holds up to 256 requests,
+                // so a request retains at most 4 KiB (1 MiB per loop).
+                const std::size_t max_retained_capacity = 4 * 1024;
+
+                req->callback = nullptr;
+                req->owner = nullptr;
+                for(auto& buf : req->bufs)
+                {
+                    if(buf.capacity() > max_retained_capacity) std::string().swap(buf);
+                    else buf.clear();
+                }
+                native::internal::loop_local<native::internal::write_req_pool>(loop).release(req);
+            }
+
+            bool submit_write(native::internal::write_req* req, uv_buf_t* bufs, int nbufs, std::function<void(error)>& callback, stream* send_handle=nullptr)
+            {
+                req->callback = std::move(callback);
+                auto on_write = [](uv_write_t* r, int status) {
+                    auto req = reinterpret_cast<native::internal::write_req*>(r->data);
+                    auto loop = r->handle->loop;
+                    auto callback = std::move(req->callback);
+                    release_write_req(loop, req);
+                    if(callback) callback(status?uv_last_error(loop):error());
+                };
+
+                int result = send_handle
+                    ? uv_write2(&req->req, get<uv_stream_t>(), bufs, nbufs, send_handle->get<uv_stream_t>(), on_write)
+                    : uv_write(&req->req, get<uv_stream_t>(), bufs, nbufs, on_write);
+                if(result)
+                {
+                    release_write_req(get()->loop, req);
+                    return false;
+                }
+                return true;
+            }
         };
     }
 }
@@ -21,13 +21,13 @@ namespace native
 
         public:
             tcp()
-                : native::base::stream(new uv_tcp_t)
+                : native::base::stream(native::internal::alloc_handle<uv_tcp_t>())
             {
                 uv_tcp_init(uv_default_loop(), get<uv_tcp_t>());
             }
 
             tcp(native::loop& l)
-                : native::base::stream(new uv_tcp_t)
+                : native::base::stream(native::internal::alloc_handle<uv_tcp_t>())
             {
                 uv_tcp_init(l.get(), get<uv_tcp_t>());
             }
@@ -49,9 +49,20 @@ namespace native
             bool bind(const std::string& ip, int port) { return uv_tcp_bind(get<uv_tcp_t>(), uv_ip4_addr(ip.c_str(), port)) == 0; }
             bool bind6(const std::string& ip, int port) { return uv_tcp_bind6(get<uv_tcp_t>(), uv_ip6_addr(ip.c_str(), port)) == 0; }
 
+            /*!
+             *  Wraps an existing socket, e.g. one bound with options libuv does not set.
+             */
+            bool open(uv_os_sock_t sock) { return uv_tcp_open(get<uv_tcp_t>(), sock) == 0; }
+
+            /*!
+             *  Socket descriptor, or -1 while the socket does not exist yet.
+             *  Unix only: reads libuv's private io_watcher, as libuv 0.10 has no uv_fileno().
+             */
+            int fd() const { return get<uv_tcp_t>()->io_watcher.fd; }
+
             bool connect(const std::string& ip, int port, std::function<void(error)> callback)
             {
-                callbacks::store(get()->data, native::internal::uv_cid_connect, callback);
+                callbacks::store(get()->data, native::internal::uv_cid_connect, std::move(callback));
                 return uv_tcp_connect(new uv_connect_t, get<uv_tcp_t>(), to_ip4_addr(ip, port), [](uv_connect_t* req, int status) {
                     callbacks::invoke<decltype(callback)>(req->handle->data, native::internal::uv_cid_connect, status?uv_last_error(req->handle->loop):error());
                     delete req;
@@ -60,7 +71,7 @@ namespace native
 
             bool connect6(const std::string& ip, int port, std::function<void(error)> callback)
             {
-                callbacks::store(get()->data, native::internal::uv_cid_connect6, callback);
+                callbacks::store(get()->data, native::internal::uv_cid_connect6, std::move(callback));
                 return uv_tcp_connect6(new uv_connect_t, get<uv_tcp_t>(), to_ip6_addr(ip, port), [](uv_connect_t* req, int status) {
                     callbacks::invoke<decltype(callback)>(req->handle->data, native::internal::uv_cid_connect6, status?uv_last_error(req->handle->loop):error());
                     delete req;
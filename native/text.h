@@ -26,6 +26,11 @@ namespace native
                     nocase_compare()); // comparison
             }
         };
+
+        inline bool ci_equal(const std::string& s1, const std::string& s2)
+        {
+            return s1.length() == s2.length() && !ci_less()(s1, s2) && !ci_less()(s2, s1);
+        }
     }
 }
 
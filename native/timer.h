@@ -0,0 +1,217 @@
+#ifndef __TIMER_H__
+#define __TIMER_H__
+
+#include "base.h"
+#include "handle.h"
+#include "callback.h"
+#include "loop.h"
+
+namespace native
+{
+    class timer : public native::base::handle
+    {
+    public:
+        template<typename X>
+        timer(X* x)
+            : handle(x)
+        { }
+
+    public:
+        timer()
+            : native::base::handle(native::internal::alloc_handle<uv_timer_t>())
+        {
+            uv_timer_init(uv_default_loop(), get<uv_timer_t>());
+        }
+
+        timer(native::loop& l)
+            : native::base::handle(native::internal::alloc_handle<uv_timer_t>())
+        {
+            uv_timer_init(l.get(), get<uv_timer_t>());
+        }
+
+        /*!
+         *  Invokes callback after timeout milliseconds, then every repeat milliseconds unless repeat is 0.
+         */
+        bool start(std::function<void()> callback, int64_t timeout, int64_t repeat=0)
+        {
+            callbacks::store(get()->data, native::internal::uv_cid_timer, std::move(callback));
+            return uv_timer_start(get<uv_timer_t>(), [](uv_timer_t* t, int) {
+                callbacks::invoke<decltype(callback)>(t->data, native::internal::uv_cid_timer);
+            }, timeout, repeat) == 0;
+        }
+
+        bool stop() { return uv_timer_stop(get<uv_timer_t>()) == 0; }
+
+        /*!
+         *  Restarts a repeating timer with its repeat value as the timeout.
+         */
+        bool again() { return uv_timer_again(get<uv_timer_t>()) == 0; }
+
+        void set_repeat(int64_t repeat) { uv_timer_set_repeat(get<uv_timer_t>(), repeat); }
+        int64_t get_repeat() { return uv_timer_get_repeat(get<uv_timer_t>()); }
+    };
+
+    namespace internal
+    {
+        /*!
+         *  Hashed timer wheel of a loop (see timer_wheel::get()): any number of timeouts driven by one uv_timer_t.
+         *  Arming, rearming and stopping an entry are O(1); expiry is checked once per tick,
+         *  so a timeout fires up to one tick late. The wheel does not keep the loop alive.
+         */
+        class timer_wheel
+        {
+        public:
+            static const int64_t tick_ms = 100;
+            static const std::size_t num_slots = 512;
+
+            struct entry
+            {
+                entry()
+                    : prev(nullptr)
+                    , next(nullptr)
+                    , expires(0)
+                    , callback(nullptr)
+                    , data(nullptr)
+                {}
+
+                bool armed() const { return prev != nullptr; }
+
+                entry* prev;
+                entry* next;
+                int64_t expires; // tick
+                void (*callback)(entry* e);
+                void* data;
+            };
+
+            timer_wheel()
+                : loop_(nullptr)
+                , timer_(nullptr)
+                , current_(0)
+                , count_(0)
+                , slots_()
+            {
+                for(auto& s : slots_) s.prev = s.next = &s;
+            }
+
+            ~timer_wheel()
+            {
+                shutdown();
+            }
+
+            // closes the timer on loop teardown (see loop_data): entries armed afterwards never fire.
+            void shutdown()
+            {
+                if(timer_) uv_close(reinterpret_cast<uv_handle_t*>(timer_), [](uv_handle_t* h) { delete reinterpret_cast<uv_timer_t*>(h); });
+                timer_ = nullptr;
+            }
+
+            static timer_wheel& get(uv_loop_t* loop)
+            {
+                auto& w = loop_local<timer_wheel>(loop);
+                if(!w.loop_) w.attach(loop);
+                return w;
+            }
+
+        public:
+            /*!
+             *  (Re)arms e to invoke its callback in timeout milliseconds. e is disarmed before the callback runs.
+             */
+            void start(entry* e, int64_t timeout)
+            {
+                stop(e);
+
+                auto now = static_cast<int64_t>(uv_now(loop_));
+                if(count_++ == 0)
+                {
+                    // idle slots were all empty: skip them
+                    current_ = now / tick_ms;
+                    if(timer_) uv_timer_start(timer_, on_tick, tick_ms, tick_ms);
+                }
+
+                auto expires = (now + timeout + tick_ms - 1) / tick_ms;
+                e->expires = std::max(expires, current_ + 1);
+                link(&slots_[e->expires % num_slots], e);
+            }
+
+            void stop(entry* e)
+            {
+                if(!e->armed()) return;
+
+                unlink(e);
+                if(--count_ == 0 && timer_) uv_timer_stop(timer_);
+            }
+
+            std::size_t count() const { return count_; }
+
+        private:
+            timer_wheel(const timer_wheel&);
+            void operator =(const timer_wheel&);
+
+            void attach(uv_loop_t* loop)
+            {
+                loop_ = loop;
+                timer_ = new uv_timer_t;
+                uv_timer_init(loop, timer_);
+                timer_->data = this;
+                uv_unref(reinterpret_cast<uv_handle_t*>(timer_));
+            }
+
+            static void link(entry* head, entry* e)
+            {
+                e->prev = head->prev;
+                e->next = head;
+                head->prev->next = e;
+                head->prev = e;
+            }
+
+            static void unlink(entry* e)
+            {
+                e->prev->next = e->next;
+                e->next->prev = e->prev;
+                e->prev = e->next = nullptr;
+            }
+
+            static void on_tick(uv_timer_t* t, int)
+            {
+                auto w = reinterpret_cast<timer_wheel*>(t->data);
+                auto now = static_cast<int64_t>(uv_now(w->loop_)) / tick_ms;
+
+                // catches up on every tick missed while the loop was busy
+                while(w->current_ < now && w->count_)
+                {
+                    auto head = &w->slots_[++w->current_ % num_slots];
+
+                    // collect first: callbacks may start and stop any entry
+                    entry due;
+                    due.prev = due.next = &due;
+                    for(auto e = head->next; e != head;)
+                    {
+                        auto next = e->next;
+                        if(e->expires <= w->current_)
+                        {
+                            unlink(e);
+                            link(&due, e);
+                        }
+                        e = next;
+                    }
+
+                    while(due.next != &due)
+                    {
+                        auto e = due.next;
+                        w->stop(e);
+                        e->callback(e);
+                    }
+                }
+            }
+
+        private:
+            uv_loop_t* loop_;
+            uv_timer_t* timer_;
+            int64_t current_; // last tick processed
+            std::size_t count_;
+            entry slots_[num_slots];
+        };
+    }
+}
+
+#endif
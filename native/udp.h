@@ -0,0 +1,575 @@
+#ifndef __UDP_H__
+#define __UDP_H__
+
+#include "base.h"
+#include "error.h"
+#include "handle.h"
+#include "callback.h"
+#include "loop.h"
+#include "net.h"
+#include "pool.h"
+
+#ifdef __linux__
+#include <cerrno>
+#include <cstring>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+namespace native
+{
+    namespace net
+    {
+        /*!
+         *  Datagram delivered by udp::recv_batch_start(). data and addr are valid during the callback only.
+         */
+        struct udp_packet
+        {
+            const char* data;
+            std::size_t len;
+            const sockaddr* addr;
+            unsigned flags; // UV_UDP_PARTIAL if the datagram did not fit the packet buffer
+        };
+    }
+
+    namespace internal
+    {
+        // uv_udp_send_t with its own callback and the buffer it owns until completion.
+        struct udp_send_req
+        {
+            uv_udp_send_t req;
+            std::function<void(native::error)> callback;
+            std::string buf;
+        };
+
+        typedef object_pool<udp_send_req> udp_send_req_pool;
+
+#ifdef __linux__
+        /*!
+         *  recvmmsg()/sendmmsg() rings of a udp handle (see udp::recv_batch_start() and udp::send_batched()).
+         *  They work on a dup() of the socket watched by their own uv_poll_t, so they never conflict with the uv_udp_t's io watcher.
+         *  Queued datagrams are sent before the loop next polls for I/O; the loop is kept alive until they are.
+         */
+        class udp_batch
+        {
+        public:
+            typedef std::function<void(const native::net::udp_packet* packets, std::size_t count, native::error e)> recv_callback;
+
+            static const std::size_t send_queue_size = 1024; // UIO_MAXIOV: one sendmmsg() call at most
+            static const std::size_t max_recv_rounds = 16; // recvmmsg() calls per readable event
+            static const std::size_t max_retained_capacity = 4 * 1024;
+
+            udp_batch(uv_loop_t* loop, int fd)
+                : fd_(::dup(fd))
+                , poll_(nullptr)
+                , prepare_(nullptr)
+                , events_(0)
+                , on_recv_()
+                , packet_size_(0)
+                , recv_buffers_()
+                , recv_iov_()
+                , recv_addrs_()
+                , recv_msgs_()
+                , packets_()
+                , send_slots_(send_queue_size)
+                , send_msgs_(send_queue_size)
+                , send_head_(0)
+                , send_count_(0)
+                , on_send_error_()
+            {
+                if(fd_ < 0) return;
+
+                poll_ = new uv_poll_t;
+                uv_poll_init(loop, poll_, fd_);
+                poll_->data = this;
+
+                prepare_ = new uv_prepare_t;
+                uv_prepare_init(loop, prepare_);
+                prepare_->data = this;
+            }
+
+            ~udp_batch()
+            {
+                if(fd_ < 0) return;
+
+                uv_close(reinterpret_cast<uv_handle_t*>(poll_), [](uv_handle_t* h) { delete reinterpret_cast<uv_poll_t*>(h); });
+                uv_close(reinterpret_cast<uv_handle_t*>(prepare_), [](uv_handle_t* h) { delete reinterpret_cast<uv_prepare_t*>(h); });
+                ::close(fd_);
+            }
+
+        public:
+            bool ok() const { return fd_ >= 0; }
+
+            bool recv_start(recv_callback callback, std::size_t batch_size, std::size_t packet_size)
+            {
+                if(!batch_size || !packet_size) return false;
+
+                if(batch_size != recv_msgs_.size() || packet_size != packet_size_)
+                {
+                    // the packet ring: allocated once, refilled by every recvmmsg() call
+                    packet_size_ = packet_size;
+                    recv_buffers_.assign(batch_size * packet_size, 0);
+                    recv_iov_.resize(batch_size);
+                    recv_addrs_.resize(batch_size);
+                    recv_msgs_.resize(batch_size);
+                    packets_.resize(batch_size);
+                    for(std::size_t i = 0; i < batch_size; ++i)
+                    {
+                        recv_iov_[i].iov_base = &recv_buffers_[i * packet_size];
+                        recv_iov_[i].iov_len = packet_size;
+
+                        auto& m = recv_msgs_[i];
+                        std::memset(&m, 0, sizeof(m));
+                        m.msg_hdr.msg_name = &recv_addrs_[i];
+                        m.msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+                        m.msg_hdr.msg_iov = &recv_iov_[i];
+                        m.msg_hdr.msg_iovlen = 1;
+                    }
+                }
+
+                on_recv_ = std::move(callback);
+                return update(events_ | UV_READABLE);
+            }
+
+            bool recv_stop()
+            {
+                return update(events_ & ~UV_READABLE);
+            }
+
+            /*!
+             *  Queues a copy of the datagram. Returns false if the queue is still full after trying to flush it.
+             */
+            bool send(const sockaddr* addr, socklen_t addrlen, const char* buf, std::size_t len)
+            {
+                if(send_count_ == send_queue_size)
+                {
+                    flush();
+                    if(send_count_ == send_queue_size) return false;
+                }
+
+                auto index = (send_head_ + send_count_) % send_queue_size;
+                auto& slot = send_slots_[index];
+                slot.buf.assign(buf, len);
+                std::memcpy(&slot.addr, addr, addrlen);
+                slot.iov.iov_base = const_cast<char*>(slot.buf.data());
+                slot.iov.iov_len = len;
+
+                auto& m = send_msgs_[index];
+                std::memset(&m, 0, sizeof(m));
+                m.msg_hdr.msg_name = &slot.addr;
+                m.msg_hdr.msg_namelen = addrlen;
+                m.msg_hdr.msg_iov = &slot.iov;
+                m.msg_hdr.msg_iovlen = 1;
+
+                // while waiting for the socket to become writable, the poll handle flushes
+                if(send_count_++ == 0 && !(events_ & UV_WRITABLE)) uv_prepare_start(prepare_, on_prepare);
+                return true;
+            }
+
+            std::size_t send_queued() const { return send_count_; }
+
+            void on_send_error(std::function<void(native::error e)> callback) { on_send_error_ = std::move(callback); }
+
+        private:
+            udp_batch(const udp_batch&);
+            void operator =(const udp_batch&);
+
+            struct send_slot
+            {
+                std::string buf;
+                sockaddr_storage addr;
+                iovec iov;
+            };
+
+            bool update(int events)
+            {
+                events_ = events;
+                if(!events) return uv_poll_stop(poll_) == 0;
+                return uv_poll_start(poll_, events, on_poll) == 0;
+            }
+
+            void receive()
+            {
+                // the callback may restart receiving with another callback
+                auto callback = std::move(on_recv_);
+
+                for(std::size_t round = 0; round < max_recv_rounds && (events_ & UV_READABLE); ++round)
+                {
+                    auto batch_size = recv_msgs_.size();
+                    int n = ::recvmmsg(fd_, &recv_msgs_[0], static_cast<unsigned>(batch_size), MSG_DONTWAIT, nullptr);
+                    if(n < 0)
+                    {
+                        if(errno == EINTR) continue;
+                        if(errno != EAGAIN && errno != EWOULDBLOCK) callback(nullptr, 0, native::error(sys_error(errno)));
+                        break;
+                    }
+
+                    for(int i = 0; i < n; ++i)
+                    {
+                        auto& m = recv_msgs_[i];
+                        auto& p = packets_[i];
+                        p.data = static_cast<const char*>(recv_iov_[i].iov_base);
+                        p.len = m.msg_len;
+                        p.addr = reinterpret_cast<const sockaddr*>(&recv_addrs_[i]);
+                        p.flags = (m.msg_hdr.msg_flags & MSG_TRUNC) ? UV_UDP_PARTIAL : 0;
+
+                        m.msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+                        m.msg_hdr.msg_flags = 0;
+                    }
+                    if(n > 0) callback(&packets_[0], static_cast<std::size_t>(n), native::error());
+
+                    if(static_cast<std::size_t>(n) < batch_size) break;
+                }
+
+                if(!on_recv_) on_recv_ = std::move(callback);
+            }
+
+            void flush()
+            {
+                while(send_count_)
+                {
+                    auto n = std::min(send_count_, send_queue_size - send_head_);
+                    int sent = ::sendmmsg(fd_, &send_msgs_[send_head_], static_cast<unsigned>(n), MSG_DONTWAIT);
+                    if(sent < 0)
+                    {
+                        if(errno == EINTR) continue;
+                        if(errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) break;
+
+                        // the first datagram failed (e.g. EMSGSIZE): drop it and go on
+                        auto e = errno;
+                        pop(1);
+                        if(on_send_error_) on_send_error_(native::error(sys_error(e)));
+                        continue;
+                    }
+                    pop(static_cast<std::size_t>(sent));
+                }
+
+                uv_prepare_stop(prepare_);
+                if(send_count_) update(events_ | UV_WRITABLE);
+                else if(events_ & UV_WRITABLE) update(events_ & ~UV_WRITABLE);
+            }
+
+            void pop(std::size_t n)
+            {
+                for(std::size_t i = 0; i < n; ++i)
+                {
+                    auto& buf = send_slots_[(send_head_ + i) % send_queue_size].buf;
+                    if(buf.capacity() > max_retained_capacity) std::string().swap(buf);
+                }
+                send_head_ = (send_head_ + n) % send_queue_size;
+                send_count_ -= n;
+            }
+
+            static void on_poll(uv_poll_t* h, int status, int events)
+            {
+                auto b = reinterpret_cast<udp_batch*>(h->data);
+                if(status)
+                {
+                    if(b->on_recv_) b->on_recv_(nullptr, 0, uv_last_error(h->loop));
+                    return;
+                }
+                if(events & UV_WRITABLE) b->flush();
+                if(events & UV_READABLE) b->receive();
+            }
+
+            static void on_prepare(uv_prepare_t* h, int)
+            {
+                reinterpret_cast<udp_batch*>(h->data)->flush();
+            }
+
+        private:
+            int fd_;
+            uv_poll_t* poll_;
+            uv_prepare_t* prepare_;
+            int events_;
+            recv_callback on_recv_;
+            std::size_t packet_size_;
+            std::vector<char> recv_buffers_;
+            std::vector<iovec> recv_iov_;
+            std::vector<sockaddr_storage> recv_addrs_;
+            std::vector<mmsghdr> recv_msgs_;
+            std::vector<native::net::udp_packet> packets_;
+            std::vector<send_slot> send_slots_;
+            std::vector<mmsghdr> send_msgs_;
+            std::size_t send_head_;
+            std::size_t send_count_;
+            std::function<void(native::error e)> on_send_error_;
+        };
+#endif
+    }
+
+    namespace net
+    {
+        class udp : public native::base::handle
+        {
+        public:
+            template<typename X>
+            udp(X* x)
+                : handle(x)
+            { }
+
+        public:
+            udp()
+                : native::base::handle(native::internal::alloc_handle<uv_udp_t>())
+            {
+                uv_udp_init(uv_default_loop(), get<uv_udp_t>());
+            }
+
+            udp(native::loop& l)
+                : native::base::handle(native::internal::alloc_handle<uv_udp_t>())
+            {
+                uv_udp_init(l.get(), get<uv_udp_t>());
+            }
+
+            static std::shared_ptr<udp> create()
+            {
+                return std::shared_ptr<udp>(new udp);
+            }
+
+            /*!
+             *  @param flags UV_UDP_IPV6ONLY for bind6().
+             */
+            bool bind(const std::string& ip, int port, unsigned flags=0) { return uv_udp_bind(get<uv_udp_t>(), uv_ip4_addr(ip.c_str(), port), flags) == 0; }
+            bool bind6(const std::string& ip, int port, unsigned flags=0) { return uv_udp_bind6(get<uv_udp_t>(), uv_ip6_addr(ip.c_str(), port), flags) == 0; }
+
+            /*!
+             *  Wraps an existing socket, e.g. one bound with SO_REUSEPORT.
+             */
+            bool open(uv_os_sock_t sock) { return uv_udp_open(get<uv_udp_t>(), sock) == 0; }
+
+            /*!
+             *  Socket descriptor, or -1 until the socket is bound or opened.
+             *  Unix only, like net::tcp::fd().
+             */
+            int fd() const { return get<uv_udp_t>()->io_watcher.fd; }
+
+            bool getsockname(bool& ip4, std::string& ip, int& port)
+            {
+                struct sockaddr_storage addr;
+                int len = sizeof(addr);
+                if(uv_udp_getsockname(get<uv_udp_t>(), reinterpret_cast<struct sockaddr*>(&addr), &len) == 0)
+                {
+                    ip4 = (addr.ss_family == AF_INET);
+                    if(ip4) return from_ip4_addr(reinterpret_cast<ip4_addr*>(&addr), ip, port);
+                    else return from_ip6_addr(reinterpret_cast<ip6_addr*>(&addr), ip, port);
+                }
+                return false;
+            }
+
+            /*!
+             *  Joins (or leaves) a multicast group; an empty interface_addr lets the system choose.
+             */
+            bool set_membership(const std::string& multicast_addr, const std::string& interface_addr, bool join)
+            {
+                return uv_udp_set_membership(get<uv_udp_t>(), multicast_addr.c_str(),
+                    interface_addr.empty() ? nullptr : interface_addr.c_str(), join ? UV_JOIN_GROUP : UV_LEAVE_GROUP) == 0;
+            }
+
+            bool set_multicast_loop(bool enable) { return uv_udp_set_multicast_loop(get<uv_udp_t>(), enable?1:0) == 0; }
+            bool set_multicast_ttl(int ttl) { return uv_udp_set_multicast_ttl(get<uv_udp_t>(), ttl) == 0; }
+            bool set_broadcast(bool enable) { return uv_udp_set_broadcast(get<uv_udp_t>(), enable?1:0) == 0; }
+            bool set_ttl(int ttl) { return uv_udp_set_ttl(get<uv_udp_t>(), ttl) == 0; }
+
+            /*!
+             *  Sends len bytes from buf, which must stay valid until the callback is invoked.
+             */
+            bool send(const ip4_addr& addr, const char* buf, std::size_t len, std::function<void(error)> callback)
+            {
+                auto req = acquire_send_req(callback);
+                uv_buf_t bufs[] = { uv_buf_t { const_cast<char*>(buf), len } };
+                return check_send(req, uv_udp_send(&req->req, get<uv_udp_t>(), bufs, 1, addr, on_send));
+            }
+
+            bool send(const ip6_addr& addr, const char* buf, std::size_t len, std::function<void(error)> callback)
+            {
+                auto req = acquire_send_req(callback);
+                uv_buf_t bufs[] = { uv_buf_t { const_cast<char*>(buf), len } };
+                return check_send(req, uv_udp_send6(&req->req, get<uv_udp_t>(), bufs, 1, addr, on_send));
+            }
+
+            /*!
+             *  Sends buf, which is owned by the request until completion: move it in to avoid a copy.
+             */
+            bool send(const ip4_addr& addr, std::string buf, std::function<void(error)> callback)
+            {
+                auto req = acquire_send_req(callback);
+                req->buf = std::move(buf);
+                uv_buf_t bufs[] = { uv_buf_t { const_cast<char*>(req->buf.data()), req->buf.length() } };
+                return check_send(req, uv_udp_send(&req->req, get<uv_udp_t>(), bufs, 1, addr, on_send));
+            }
+
+            bool send(const ip6_addr& addr, std::string buf, std::function<void(error)> callback)
+            {
+                auto req = acquire_send_req(callback);
+                req->buf = std::move(buf);
+                uv_buf_t bufs[] = { uv_buf_t { const_cast<char*>(req->buf.data()), req->buf.length() } };
+                return check_send(req, uv_udp_send6(&req->req, get<uv_udp_t>(), bufs, 1, addr, on_send));
+            }
+
+            /*!
+             *  Starts receiving into buffers taken from the loop's read buffer pool (see native::set_read_buffer_pool()).
+             *  The buffer goes back to the pool when the callback returns. len < 0 means a read error, see loop::last_error().
+             */
+            bool recv_start(std::function<void(const char* buf, ssize_t len, const sockaddr* addr, unsigned flags)> callback)
+            {
+                callbacks::store(get()->data, native::internal::uv_cid_udp_recv, std::move(callback));
+
+                return uv_udp_recv_start(get<uv_udp_t>(), alloc_recv_buffer,
+                    [](uv_udp_t* h, ssize_t nread, uv_buf_t buf, struct sockaddr* addr, unsigned flags) {
+                        // nothing read and no sender: the socket was not readable after all
+                        if(nread != 0 || addr)
+                        {
+                            callbacks::invoke<decltype(callback)>(h->data, native::internal::uv_cid_udp_recv,
+                                nread < 0 ? nullptr : buf.base, nread, addr, flags);
+                        }
+                        native::internal::loop_local<native::internal::buffer_pool>(h->loop).release(buf.base, buf.len);
+                    }) == 0;
+            }
+
+            bool recv_stop() { return uv_udp_recv_stop(get<uv_udp_t>()) == 0; }
+
+            /*!
+             *  Starts receiving up to batch_size datagrams per system call (recvmmsg() on Linux) into a ring of
+             *  packet buffers allocated once. Datagrams longer than packet_size are truncated (UV_UDP_PARTIAL).
+             *  The socket must be bound first; do not mix with recv_start(). Elsewhere, every datagram is a batch of one.
+             */
+            bool recv_batch_start(std::function<void(const udp_packet* packets, std::size_t count, error e)> callback,
+                std::size_t batch_size=64, std::size_t packet_size=2048)
+            {
+#ifdef __linux__
+                auto b = batch();
+                return b && b->recv_start(std::move(callback), batch_size, packet_size);
+#else
+                auto loop = get()->loop;
+                return recv_start([=](const char* buf, ssize_t len, const sockaddr* addr, unsigned flags) {
+                    if(len < 0) return callback(nullptr, 0, uv_last_error(loop));
+                    udp_packet p = { buf, static_cast<std::size_t>(len), addr, flags };
+                    callback(&p, 1, error());
+                });
+#endif
+            }
+
+            bool recv_batch_stop()
+            {
+#ifdef __linux__
+                auto b = batch();
+                return b && b->recv_stop();
+#else
+                return recv_stop();
+#endif
+            }
+
+            /*!
+             *  Queues a copy of the datagram: everything queued during a loop iteration goes out with one sendmmsg() call on Linux.
+             *  Returns false if the queue is full. Binds to any address first if the socket is not bound yet.
+             *  Queued datagrams are dropped when the handle is closed.
+             */
+            bool send_batched(const ip4_addr& addr, const char* buf, std::size_t len)
+            {
+#ifdef __linux__
+                if(fd() < 0 && !bind("0.0.0.0", 0)) return false;
+                auto b = batch();
+                return b && b->send(reinterpret_cast<const sockaddr*>(&addr), sizeof(addr), buf, len);
+#else
+                return send(addr, std::string(buf, len), send_batched_callback());
+#endif
+            }
+
+            bool send_batched(const ip6_addr& addr, const char* buf, std::size_t len)
+            {
+#ifdef __linux__
+                if(fd() < 0 && !bind6("::", 0)) return false;
+                auto b = batch();
+                return b && b->send(reinterpret_cast<const sockaddr*>(&addr), sizeof(addr), buf, len);
+#else
+                return send(addr, std::string(buf, len), send_batched_callback());
+#endif
+            }
+
+            /*!
+             *  Sets the callback for datagrams queued by send_batched() that could not be sent. The socket must be bound first.
+             */
+            bool on_send_batched_error(std::function<void(error e)> callback)
+            {
+#ifdef __linux__
+                auto b = batch();
+                if(b) b->on_send_error(std::move(callback));
+                return b != nullptr;
+#else
+                native::internal::handle_state(get<uv_udp_t>()) = std::make_shared<std::function<void(error e)>>(std::move(callback));
+                return true;
+#endif
+            }
+
+        private:
+            static uv_buf_t alloc_recv_buffer(uv_handle_t* h, size_t)
+            {
+                auto& pool = native::internal::loop_local<native::internal::buffer_pool>(h->loop);
+                return uv_buf_init(pool.acquire(pool.buffer_size()), pool.buffer_size());
+            }
+
+            native::internal::udp_send_req* acquire_send_req(std::function<void(error)>& callback)
+            {
+                auto req = native::internal::loop_local<native::internal::udp_send_req_pool>(get()->loop).acquire();
+                req->req.data = req;
+                req->callback = std::move(callback);
+                return req;
+            }
+
+            static void release_send_req(uv_loop_t* loop, native::internal::udp_send_req* req)
+            {
+                const std::size_t max_retained_capacity = 64 * 1024;
+
+                req->callback = nullptr;
+                if(req->buf.capacity() > max_retained_capacity) std::string().swap(req->buf);
+                else req->buf.clear();
+                native::internal::loop_local<native::internal::udp_send_req_pool>(loop).release(req);
+            }
+
+            bool check_send(native::internal::udp_send_req* req, int result)
+            {
+                if(result)
+                {
+                    release_send_req(get()->loop, req);
+                    return false;
+                }
+                return true;
+            }
+
+            static void on_send(uv_udp_send_t* r, int status)
+            {
+                auto req = reinterpret_cast<native::internal::udp_send_req*>(r->data);
+                auto loop = r->handle->loop;
+                auto callback = std::move(req->callback);
+                release_send_req(loop, req);
+                if(callback) callback(status?uv_last_error(loop):error());
+            }
+
+#ifdef __linux__
+            // created on first use, once the socket exists
+            native::internal::udp_batch* batch()
+            {
+                auto& state = native::internal::handle_state(get<uv_udp_t>());
+                if(!state)
+                {
+                    if(fd() < 0) return nullptr;
+                    auto b = std::make_shared<native::internal::udp_batch>(get()->loop, fd());
+                    if(!b->ok()) return nullptr;
+                    state = b;
+                }
+                return static_cast<native::internal::udp_batch*>(state.get());
+            }
+#else
+            std::function<void(error)> send_batched_callback()
+            {
+                auto state = native::internal::handle_state(get<uv_udp_t>());
+                if(!state) return nullptr;
+                auto on_error = std::static_pointer_cast<std::function<void(error e)>>(state);
+                return [on_error](error e) { if(e) (*on_error)(e); };
+            }
+#endif
+        };
+    }
+}
+
+#endif
@@ -0,0 +1,334 @@
+#ifndef __URING_H__
+#define __URING_H__
+
+#include "base.h"
+#include "loop.h"
+
+// io_uring engine for fs::open/read/write/close: opt in with -DNATIVE_WITH_IO_URING (Linux 5.6+).
+#if defined(NATIVE_WITH_IO_URING) && defined(__linux__)
+#define NATIVE_HAS_IO_URING 1
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace native
+{
+    namespace internal
+    {
+        /*!
+         *  Operation submitted to a uring. done is invoked on the loop's thread with the result (>= 0, or -errno).
+         */
+        struct uring_op
+        {
+            void (*done)(uring_op* op, int res);
+            void* data;
+        };
+
+        /*!
+         *  io_uring instance of a loop (see loop_local()).
+         *  Submissions are batched and entered once per loop iteration from a uv_prepare_t; completions are
+         *  reaped when the ring's eventfd becomes readable. The loop is kept alive while operations are in flight.
+         *  If the kernel lacks io_uring or one of the operations used, available() is false and callers use the threadpool.
+         */
+        class uring
+        {
+        public:
+            static const unsigned queue_depth = 256;
+
+            uring()
+                : initialized_(false)
+                , ring_fd_(-1)
+                , event_fd_(-1)
+                , poll_(nullptr)
+                , prepare_(nullptr)
+                , sq_ring_(nullptr)
+                , cq_ring_(nullptr)
+                , sq_ring_size_(0)
+                , cq_ring_size_(0)
+                , sqes_(nullptr)
+                , sqes_size_(0)
+                , sq_head_(nullptr)
+                , sq_tail_(nullptr)
+                , sq_mask_(0)
+                , sq_entries_(0)
+                , sq_array_(nullptr)
+                , cq_head_(nullptr)
+                , cq_tail_(nullptr)
+                , cq_mask_(0)
+                , cq_entries_(0)
+                , cqes_(nullptr)
+                , tail_(0)
+                , to_submit_(0)
+                , in_flight_(0)
+                , current_position_(false)
+            {}
+
+            ~uring()
+            {
+                shutdown();
+            }
+
+        public:
+            /*!
+             *  Delivers the completions of every operation still in flight, then releases the ring and closes its
+             *  handles. Called while the loop's other objects still exist (see loop_data): completions release
+             *  requests and buffers into their pools. Operations started meanwhile go to the threadpool.
+             */
+            void shutdown()
+            {
+                if(ring_fd_ < 0) return;
+                auto fd = ring_fd_;
+                ring_fd_ = -1; // available() is false from now on
+
+                // the kernel still writes into the buffers of operations in flight: wait for them before unmapping.
+                while(in_flight_)
+                {
+                    auto n = ::syscall(__NR_io_uring_enter, fd, to_submit_, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+                    if(n < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) break;
+                    if(n > 0) to_submit_ -= static_cast<unsigned>(n);
+                    reap();
+                }
+                assert(!in_flight_);
+
+                uv_close(reinterpret_cast<uv_handle_t*>(poll_), [](uv_handle_t* h) { delete reinterpret_cast<uv_poll_t*>(h); });
+                uv_close(reinterpret_cast<uv_handle_t*>(prepare_), [](uv_handle_t* h) { delete reinterpret_cast<uv_prepare_t*>(h); });
+                unmap();
+                ::close(event_fd_);
+                ::close(fd);
+                event_fd_ = -1;
+            }
+
+            bool available(uv_loop_t* loop)
+            {
+                if(!initialized_) init(loop);
+                return ring_fd_ >= 0;
+            }
+
+            /*!
+             *  Whether an offset of -1 (the current file position) is supported for reads and writes.
+             */
+            bool current_position() const { return current_position_; }
+
+            /*!
+             *  Returns a cleared SQE, or nullptr if the ring is full.
+             */
+            io_uring_sqe* get_sqe()
+            {
+                // completions must never overflow the CQ
+                if(in_flight_ >= cq_entries_) return nullptr;
+
+                if(tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_)
+                {
+                    enter();
+                    if(tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_) return nullptr;
+                }
+
+                auto index = tail_ & sq_mask_;
+                auto sqe = &sqes_[index];
+                std::memset(sqe, 0, sizeof(*sqe));
+                sq_array_[index] = index;
+                return sqe;
+            }
+
+            /*!
+             *  Queues the SQE from get_sqe(): it is submitted before the loop next polls for I/O.
+             */
+            void submit(io_uring_sqe* sqe, uring_op* op)
+            {
+                sqe->user_data = reinterpret_cast<uint64_t>(op);
+                __atomic_store_n(sq_tail_, ++tail_, __ATOMIC_RELEASE);
+                ++to_submit_;
+                if(in_flight_++ == 0) uv_ref(reinterpret_cast<uv_handle_t*>(poll_));
+            }
+
+        private:
+            uring(const uring&);
+            void operator =(const uring&);
+
+            void init(uv_loop_t* loop)
+            {
+                initialized_ = true;
+
+                io_uring_params p;
+                std::memset(&p, 0, sizeof(p));
+                int fd = static_cast<int>(::syscall(__NR_io_uring_setup, queue_depth, &p));
+                if(fd < 0) return;
+
+                if(!supported(fd) || !map(fd, p))
+                {
+                    unmap();
+                    ::close(fd);
+                    return;
+                }
+
+                int efd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+                if(efd < 0 || ::syscall(__NR_io_uring_register, fd, IORING_REGISTER_EVENTFD, &efd, 1) < 0)
+                {
+                    if(efd >= 0) ::close(efd);
+                    unmap();
+                    ::close(fd);
+                    return;
+                }
+
+                ring_fd_ = fd;
+                event_fd_ = efd;
+                current_position_ = (p.features & IORING_FEAT_RW_CUR_POS) != 0;
+
+                poll_ = new uv_poll_t;
+                uv_poll_init(loop, poll_, event_fd_);
+                poll_->data = this;
+                uv_poll_start(poll_, UV_READABLE, [](uv_poll_t* h, int, int) {
+                    reinterpret_cast<uring*>(h->data)->reap();
+                });
+                uv_unref(reinterpret_cast<uv_handle_t*>(poll_));
+
+                prepare_ = new uv_prepare_t;
+                uv_prepare_init(loop, prepare_);
+                prepare_->data = this;
+                uv_prepare_start(prepare_, [](uv_prepare_t* h, int) {
+                    reinterpret_cast<uring*>(h->data)->enter();
+                });
+                uv_unref(reinterpret_cast<uv_handle_t*>(prepare_));
+            }
+
+            // the kernel must support every operation fs uses
+            static bool supported(int fd)
+            {
+                const unsigned max_ops = 256;
+                auto size = sizeof(io_uring_probe) + max_ops * sizeof(io_uring_probe_op);
+                auto probe = static_cast<io_uring_probe*>(std::calloc(1, size));
+                if(!probe) return false;
+
+                bool ok = ::syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, max_ops) >= 0;
+                const int ops[] = { IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_CLOSE };
+                for(auto op : ops)
+                {
+                    ok = ok && op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+                }
+                std::free(probe);
+                return ok;
+            }
+
+            bool map(int fd, const io_uring_params& p)
+            {
+                sq_ring_size_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+                cq_ring_size_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+                bool single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+                if(single) sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+
+                auto sq = ::mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+                if(sq == MAP_FAILED) return false;
+                sq_ring_ = static_cast<char*>(sq);
+
+                if(single)
+                {
+                    cq_ring_ = sq_ring_;
+                }
+                else
+                {
+                    auto cq = ::mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+                    if(cq == MAP_FAILED) return false;
+                    cq_ring_ = static_cast<char*>(cq);
+                }
+
+                sqes_size_ = p.sq_entries * sizeof(io_uring_sqe);
+                auto sqes = ::mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+                if(sqes == MAP_FAILED) return false;
+                sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+                sq_head_ = reinterpret_cast<unsigned*>(sq_ring_ + p.sq_off.head);
+                sq_tail_ = reinterpret_cast<unsigned*>(sq_ring_ + p.sq_off.tail);
+                sq_mask_ = *reinterpret_cast<unsigned*>(sq_ring_ + p.sq_off.ring_mask);
+                sq_entries_ = *reinterpret_cast<unsigned*>(sq_ring_ + p.sq_off.ring_entries);
+                sq_array_ = reinterpret_cast<unsigned*>(sq_ring_ + p.sq_off.array);
+                cq_head_ = reinterpret_cast<unsigned*>(cq_ring_ + p.cq_off.head);
+                cq_tail_ = reinterpret_cast<unsigned*>(cq_ring_ + p.cq_off.tail);
+                cq_mask_ = *reinterpret_cast<unsigned*>(cq_ring_ + p.cq_off.ring_mask);
+                cq_entries_ = *reinterpret_cast<unsigned*>(cq_ring_ + p.cq_off.ring_entries);
+                cqes_ = reinterpret_cast<io_uring_cqe*>(cq_ring_ + p.cq_off.cqes);
+                tail_ = *sq_tail_;
+                return true;
+            }
+
+            void unmap()
+            {
+                if(sqes_) ::munmap(sqes_, sqes_size_);
+                if(cq_ring_ && cq_ring_ != sq_ring_) ::munmap(cq_ring_, cq_ring_size_);
+                if(sq_ring_) ::munmap(sq_ring_, sq_ring_size_);
+                sqes_ = nullptr;
+                cq_ring_ = sq_ring_ = nullptr;
+            }
+
+            // submits everything queued since the last call
+            void enter()
+            {
+                while(to_submit_)
+                {
+                    auto n = ::syscall(__NR_io_uring_enter, ring_fd_, to_submit_, 0, 0, nullptr, 0);
+                    if(n < 0)
+                    {
+                        if(errno == EINTR) continue;
+                        break; // EAGAIN/EBUSY: retried on the next iteration
+                    }
+                    to_submit_ -= static_cast<unsigned>(n);
+                }
+            }
+
+            void reap()
+            {
+                uint64_t count;
+                while(::read(event_fd_, &count, sizeof(count)) < 0 && errno == EINTR);
+
+                auto head = *cq_head_;
+                while(head != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE))
+                {
+                    auto cqe = &cqes_[head & cq_mask_];
+                    auto op = reinterpret_cast<uring_op*>(cqe->user_data);
+                    auto res = cqe->res;
+                    __atomic_store_n(cq_head_, ++head, __ATOMIC_RELEASE);
+
+                    if(--in_flight_ == 0) uv_unref(reinterpret_cast<uv_handle_t*>(poll_));
+                    op->done(op, res);
+                }
+            }
+
+        private:
+            bool initialized_;
+            int ring_fd_;
+            int event_fd_;
+            uv_poll_t* poll_;
+            uv_prepare_t* prepare_;
+            char* sq_ring_;
+            char* cq_ring_;
+            std::size_t sq_ring_size_;
+            std::size_t cq_ring_size_;
+            io_uring_sqe* sqes_;
+            std::size_t sqes_size_;
+            unsigned* sq_head_;
+            unsigned* sq_tail_;
+            unsigned sq_mask_;
+            unsigned sq_entries_;
+            unsigned* sq_array_;
+            unsigned* cq_head_;
+            unsigned* cq_tail_;
+            unsigned cq_mask_;
+            unsigned cq_entries_;
+            io_uring_cqe* cqes_;
+            unsigned tail_; // local SQ tail
+            unsigned to_submit_;
+            unsigned in_flight_;
+            bool current_position_;
+        };
+    }
+}
+
+#endif
+
+#endif
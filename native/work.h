@@ -0,0 +1,338 @@
+#ifndef __WORK_H__
+#define __WORK_H__
+
+#include "base.h"
+#include "error.h"
+#include "loop.h"
+#include "pool.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+namespace native
+{
+    namespace work
+    {
+        namespace internal
+        {
+            struct work_req
+            {
+                uv_work_t req;
+                std::function<void()> work;
+                std::function<void(error e)> done;
+            };
+
+            typedef native::internal::object_pool<work_req> work_req_pool;
+
+            inline bool queue(uv_loop_t* loop, std::function<void()> work, std::function<void(error e)> on_done)
+            {
+                auto r = native::internal::loop_local<work_req_pool>(loop).acquire();
+                r->req.data = r;
+                r->work = std::move(work);
+                r->done = std::move(on_done);
+
+                auto after_work = [](uv_work_t* req, int status) {
+                    auto r = reinterpret_cast<work_req*>(req->data);
+                    auto loop = req->loop;
+                    auto done = std::move(r->done);
+                    r->work = nullptr;
+                    r->done = nullptr;
+                    native::internal::loop_local<work_req_pool>(loop).release(r);
+
+                    if(done) done(status ? error(uv_last_error(loop)) : error());
+                };
+
+                if(uv_queue_work(loop, &r->req, [](uv_work_t* req) {
+                    reinterpret_cast<work_req*>(req->data)->work();
+                }, after_work))
+                {
+                    r->work = nullptr;
+                    r->done = nullptr;
+                    native::internal::loop_local<work_req_pool>(loop).release(r);
+                    return false;
+                }
+                return true;
+            }
+
+            // results of pool tasks on their way back to a loop (see loop_local())
+            class completions
+            {
+            public:
+                completions()
+                    : queue_()
+                    , pending_(0)
+                {}
+
+                // loop thread only
+                native::internal::post_queue* acquire(uv_loop_t* loop)
+                {
+                    if(!queue_) queue_.reset(new native::internal::post_queue(loop));
+                    if(pending_++ == 0) queue_->ref();
+                    return queue_.get();
+                }
+
+                void release()
+                {
+                    if(--pending_ == 0) queue_->unref();
+                }
+
+                // loop teardown (see loop_data): results of work still running are dropped.
+                void shutdown()
+                {
+                    if(queue_) queue_->close();
+                }
+
+            private:
+                completions(const completions&);
+                void operator =(const completions&);
+
+            private:
+                std::unique_ptr<native::internal::post_queue> queue_;
+                std::size_t pending_;
+            };
+        }
+
+        /*!
+         *  Runs work on the libuv threadpool, then on_done on the loop's thread.
+         *  on_done receives UV_ECANCELED if the work was cancelled. work must not throw.
+         */
+        inline bool queue(std::function<void()> work, std::function<void(error e)> on_done)
+        {
+            return internal::queue(uv_default_loop(), std::move(work), std::move(on_done));
+        }
+
+        inline bool queue(native::loop& l, std::function<void()> work, std::function<void(error e)> on_done)
+        {
+            return internal::queue(l.get(), std::move(work), std::move(on_done));
+        }
+
+        /*!
+         *  Dedicated pool of threads for CPU-bound work, separate from the libuv threadpool that serves fs requests.
+         *  Every worker has its own deque: it takes tasks from the front, idle workers steal from the back.
+         *  Completions are delivered on the loop that submitted the task, which stays alive until they are.
+         */
+        class pool
+        {
+        public:
+            struct stats
+            {
+                std::size_t queued; // waiting for a worker
+                std::size_t running;
+                uint64_t completed;
+                uint64_t stolen; // taken from another worker's deque
+                uint64_t total_wait_ns; // queued until started
+                uint64_t total_exec_ns;
+                uint64_t max_exec_ns;
+            };
+
+            /*!
+             *  @param num_threads number of worker threads; 0 means one per hardware thread.
+             */
+            pool(std::size_t num_threads=0)
+                : workers_()
+                , next_(0)
+                , queued_(0)
+                , running_(0)
+                , completed_(0)
+                , stolen_(0)
+                , total_wait_ns_(0)
+                , total_exec_ns_(0)
+                , max_exec_ns_(0)
+                , sleepers_(0)
+                , stopping_(false)
+                , sleep_mutex_()
+                , wakeup_()
+            {
+                if(!num_threads) num_threads = std::max(1u, std::thread::hardware_concurrency());
+
+                for(std::size_t i = 0; i < num_threads; ++i) workers_.emplace_back(new worker);
+                for(std::size_t i = 0; i < num_threads; ++i) workers_[i]->thread = std::thread([=]() { run(i); });
+            }
+
+            /*!
+             *  Runs the tasks still queued, then joins the workers.
+             */
+            virtual ~pool()
+            {
+                {
+                    std::lock_guard<std::mutex> lock(sleep_mutex_);
+                    stopping_ = true;
+                }
+                wakeup_.notify_all();
+
+                for(auto& w : workers_) w->thread.join();
+            }
+
+        public:
+            /*!
+             *  Runs work on a pool thread, then on_done on the loop's thread. Call it on the loop's thread.
+             *  work must not throw.
+             */
+            bool submit(std::function<void()> work, std::function<void(error e)> on_done)
+            {
+                return submit(uv_default_loop(), std::move(work), std::move(on_done));
+            }
+
+            bool submit(native::loop& l, std::function<void()> work, std::function<void(error e)> on_done)
+            {
+                return submit(l.get(), std::move(work), std::move(on_done));
+            }
+
+            stats get_stats() const
+            {
+                stats s;
+                s.queued = queued_.load();
+                s.running = running_.load();
+                s.completed = completed_.load();
+                s.stolen = stolen_.load();
+                s.total_wait_ns = total_wait_ns_.load();
+                s.total_exec_ns = total_exec_ns_.load();
+                s.max_exec_ns = max_exec_ns_.load();
+                return s;
+            }
+
+            std::size_t size() const { return workers_.size(); }
+
+        private:
+            // take() attempts of an idle worker before it sleeps
+            static const unsigned max_steal_rounds = 4;
+
+            pool(const pool&);
+            void operator =(const pool&);
+
+            struct task
+            {
+                std::function<void()> work;
+                std::function<void(error e)> done;
+                uv_loop_t* loop;
+                native::internal::post_queue* completions;
+                uint64_t queued_at;
+            };
+
+            struct worker
+            {
+                std::mutex mutex;
+                std::deque<task*> tasks;
+                std::thread thread;
+            };
+
+            bool submit(uv_loop_t* loop, std::function<void()> work, std::function<void(error e)> on_done)
+            {
+                if(stopping_) return false;
+
+                auto t = new task;
+                t->work = std::move(work);
+                t->done = std::move(on_done);
+                t->loop = loop;
+                t->completions = native::internal::loop_local<internal::completions>(loop).acquire(loop);
+                t->queued_at = uv_hrtime();
+
+                ++queued_;
+                auto& w = *workers_[next_++ % workers_.size()];
+                {
+                    std::lock_guard<std::mutex> lock(w.mutex);
+                    w.tasks.push_back(t);
+                }
+
+                // a waiting worker either finds the task or is notified
+                if(sleepers_.load())
+                {
+                    std::lock_guard<std::mutex> lock(sleep_mutex_);
+                    wakeup_.notify_one();
+                }
+                return true;
+            }
+
+            task* take(std::size_t self)
+            {
+                {
+                    auto& w = *workers_[self];
+                    std::lock_guard<std::mutex> lock(w.mutex);
+                    if(!w.tasks.empty())
+                    {
+                        auto t = w.tasks.front();
+                        w.tasks.pop_front();
+                        return t;
+                    }
+                }
+
+                for(std::size_t i = 1; i < workers_.size(); ++i)
+                {
+                    auto& w = *workers_[(self + i) % workers_.size()];
+                    std::lock_guard<std::mutex> lock(w.mutex);
+                    if(!w.tasks.empty())
+                    {
+                        auto t = w.tasks.back();
+                        w.tasks.pop_back();
+                        ++stolen_;
+                        return t;
+                    }
+                }
+                return nullptr;
+            }
+
+            void run(std::size_t self)
+            {
+                for(;;)
+                {
+                    // queued_ also counts tasks being pushed or just taken: retry a few times only, then sleep.
+                    auto t = take(self);
+                    for(unsigned round = 1; !t && queued_.load() && round < max_steal_rounds; ++round)
+                    {
+                        std::this_thread::yield();
+                        t = take(self);
+                    }
+
+                    if(!t)
+                    {
+                        // submit() pushes, then notifies if sleepers_ is set: a task it pushes after sleepers_
+                        // is raised is either found by take() below or notified, never lost.
+                        std::unique_lock<std::mutex> lock(sleep_mutex_);
+                        ++sleepers_;
+                        while(!(t = take(self)) && !stopping_) wakeup_.wait(lock);
+                        --sleepers_;
+                        if(!t) return;
+                    }
+
+                    --queued_;
+                    ++running_;
+                    auto started = uv_hrtime();
+                    t->work();
+                    auto exec = uv_hrtime() - started;
+                    --running_;
+
+                    total_wait_ns_ += started - t->queued_at;
+                    total_exec_ns_ += exec;
+                    auto max = max_exec_ns_.load();
+                    while(exec > max && !max_exec_ns_.compare_exchange_weak(max, exec));
+                    ++completed_;
+
+                    t->completions->push([t]() {
+                        std::unique_ptr<task> done(t);
+                        native::internal::loop_local<internal::completions>(t->loop).release();
+                        if(t->done) t->done(error());
+                    });
+                }
+            }
+
+        private:
+            std::vector<std::unique_ptr<worker>> workers_;
+            std::atomic<std::size_t> next_;
+            std::atomic<std::size_t> queued_;
+            std::atomic<std::size_t> running_;
+            std::atomic<uint64_t> completed_;
+            std::atomic<uint64_t> stolen_;
+            std::atomic<uint64_t> total_wait_ns_;
+            std::atomic<uint64_t> total_exec_ns_;
+            std::atomic<uint64_t> max_exec_ns_;
+            std::atomic<std::size_t> sleepers_;
+            std::atomic<bool> stopping_;
+            std::mutex sleep_mutex_;
+            std::condition_variable wakeup_;
+        };
+    }
+}
+
+#endif
@@ -0,0 +1,91 @@
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <algorithm>
+#include <native/native.h>
+using namespace native;
+
+// usage: (executable)  [work_dir]
+// IOPS and latency of random 4 KiB fs::read()s at several queue depths. Built twice by `make bench`:
+// uring_bench goes through io_uring (when the kernel supports it), uring_bench_threadpool through libuv's threadpool.
+
+static const std::size_t file_size = 64 * 1024 * 1024;
+static const std::size_t block_size = 4096;
+static const int reads_per_depth = 20000;
+
+struct reader
+{
+    fs::file_handle fd;
+    int left;
+    unsigned seed;
+    std::vector<uint64_t> latencies;
+
+    void issue()
+    {
+        if(left <= 0) return;
+        --left;
+
+        seed = seed * 1103515245 + 12345;
+        off_t offset = static_cast<off_t>((seed >> 4) % (file_size / block_size)) * block_size;
+        auto start = uv_hrtime();
+        fs::read(fd, block_size, offset, [this, start](const std::string& data, error e) {
+            if(e || data.size() != block_size)
+            {
+                std::cout << "fs::read() failed: " << e.str() << std::endl;
+                std::exit(1);
+            }
+            latencies.push_back(uv_hrtime() - start);
+            issue();
+        });
+    }
+};
+
+int main(int argc, char** argv) {
+    std::string path = std::string(argc > 1 ? argv[1] : "/tmp") + "/uring_bench.dat";
+    {
+        auto f = std::fopen(path.c_str(), "wb");
+        std::string block(64 * 1024, 'x');
+        for(std::size_t n = 0; n < file_size; n += block.size()) std::fwrite(block.data(), 1, block.size(), f);
+        std::fclose(f);
+    }
+
+    const char* engine = "threadpool";
+#ifdef NATIVE_HAS_IO_URING
+    if(native::internal::loop_local<native::internal::uring>(uv_default_loop()).available(uv_default_loop())) engine = "io_uring";
+#endif
+
+    fs::file_handle fd = -1;
+    fs::open(path, fs::read_only, 0, [&fd](fs::file_handle f, error e) {
+        if(e) std::cout << "fs::open() failed: " << e.str() << std::endl;
+        fd = f;
+    });
+    run();
+    if(fd < 0) return 1;
+
+    const int depths[] = { 1, 8, 32 };
+    for(auto depth : depths)
+    {
+        reader r;
+        r.fd = fd;
+        r.left = reads_per_depth;
+        r.seed = 7;
+        r.latencies.reserve(reads_per_depth);
+
+        auto start = uv_hrtime();
+        for(int i = 0; i < depth; ++i) r.issue();
+        run();
+        auto elapsed = uv_hrtime() - start;
+
+        std::sort(r.latencies.begin(), r.latencies.end());
+        std::printf("%-10s depth %2d  %8.0f IOPS  p50 %7.1f us  p99 %7.1f us\n", engine, depth,
+            reads_per_depth * 1e9 / elapsed,
+            r.latencies[r.latencies.size() / 2] / 1000.0,
+            r.latencies[r.latencies.size() * 99 / 100] / 1000.0);
+    }
+
+    fs::close(fd, [](error) {});
+    run();
+    std::remove(path.c_str());
+    return 0;
+}